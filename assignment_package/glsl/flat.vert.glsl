@@ -4,7 +4,17 @@
 // Refer to the lambert shader files for useful comments
 
 uniform mat4 u_Model;
-uniform mat4 u_ViewProj;
+
+// Filled once a frame and shared by every scene shader. Matches
+// FrameUniforms in shaderprogram.h.
+layout(std140) uniform FrameData {
+    mat4 u_ViewProj;
+    mat4 u_ViewProjInv;
+    mat4 u_ShadowMVP[3]; // SHADOW_CASCADES of them
+    vec4 u_CameraPos;
+    vec4 u_LightDir;
+    float u_Time;
+};
 
 in vec4 vs_Pos;
 in vec4 vs_Col;
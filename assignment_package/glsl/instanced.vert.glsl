@@ -7,9 +7,16 @@
 //This simultaneous transformation allows your program to run much faster, especially when rendering
 //geometry with millions of vertices.
 
-uniform mat4 u_ViewProj;    // The matrix that defines the camera's transformation.
-                            // We've written a static matrix for you to use for HW2,
-                            // but in HW3 you'll have to generate one yourself
+// Filled once a frame and shared by every scene shader. Matches
+// FrameUniforms in shaderprogram.h.
+layout(std140) uniform FrameData {
+    mat4 u_ViewProj;
+    mat4 u_ViewProjInv;
+    mat4 u_ShadowMVP[3]; // SHADOW_CASCADES of them
+    vec4 u_CameraPos;
+    vec4 u_LightDir;
+    float u_Time;
+};
 
 in vec4 vs_Pos;             // The array of vertex positions passed to the shader
 in vec4 vs_Nor;             // The array of vertex normals passed to the shader
@@ -13,9 +13,18 @@
 
 uniform vec4 u_Color = vec4(0.0, 1.0, 0.0, 1.0); // The color with which to render this instance of geometry.
 uniform sampler2D u_Texture;
-uniform float u_Time;
-uniform sampler2D u_ShadowMap;
-uniform vec3 u_CameraPos;
+uniform sampler2DArray u_ShadowMap; // One layer per shadow cascade
+
+// Filled once a frame and shared by every scene shader. Matches
+// FrameUniforms in shaderprogram.h.
+layout(std140) uniform FrameData {
+    mat4 u_ViewProj;
+    mat4 u_ViewProjInv;
+    mat4 u_ShadowMVP[3]; // SHADOW_CASCADES of them
+    vec4 u_CameraPos;
+    vec4 u_LightDir;
+    float u_Time;
+};
 
 // These are the interpolated values out of the rasterizer, so you can't know
 // their specific values without knowing the vertices that contributed to them
@@ -23,7 +32,6 @@ in vec4 fs_Pos;
 in vec4 fs_Nor;
 in vec4 fs_LightVec;
 in vec4 fs_UV;
-in vec4 fs_ShadowPos;
 
 out vec4 out_Col; // This is the final output color that you will see on your
 // screen for the pixel that is currently being processed.
@@ -41,7 +49,7 @@ void main()
 
         //blinn-phong
         vec3 N = normalize(vec3(fs_Nor));
-        vec3 V = normalize(u_CameraPos - fs_Pos.xyz);
+        vec3 V = normalize(u_CameraPos.xyz - fs_Pos.xyz);
         vec3 L = normalize(fs_LightVec.xyz);
         vec3 H = normalize(V + L);
 
@@ -64,7 +72,15 @@ void main()
 
     float ambientBias = 0.001f;
 
-    float visibility = texture( u_ShadowMap, fs_ShadowPos.xy).z < fs_ShadowPos.z-clamp(0.002*tan(acos(cosTheta)) + ambientBias, 0, 0.01)? 0.5 : 1.0;
+    // Look in the finest cascade that covers this fragment
+    float visibility = 1.0;
+    for (int i = 0; i < 3; i++) {
+        vec4 shadowPos = u_ShadowMVP[i] * vec4(fs_Pos.xyz, 1.0);
+        if (all(greaterThan(shadowPos.xyz, vec3(0.0))) && all(lessThan(shadowPos.xyz, vec3(1.0)))) {
+            visibility = texture(u_ShadowMap, vec3(shadowPos.xy, i)).r < shadowPos.z-clamp(0.002*tan(acos(cosTheta)) + ambientBias, 0, 0.01)? 0.5 : 1.0;
+            break;
+        }
+    }
 
     // Calculate the diffuse term for Lambert shading
     float diffuseTerm = dot(normalize(fs_Nor), normalize(fs_LightVec));
@@ -16,14 +16,19 @@ uniform mat4 u_ModelInvTr;  // The inverse transpose of the model matrix.
                             // This allows us to transform the object's normals properly
                             // if the object has been non-uniformly scaled.
 
-uniform mat4 u_ViewProj;    // The matrix that defines the camera's transformation.
-                            // We've written a static matrix for you to use for HW2,
-                            // but in HW3 you'll have to generate one yourself
+// Filled once a frame and shared by every scene shader. Matches
+// FrameUniforms in shaderprogram.h.
+layout(std140) uniform FrameData {
+    mat4 u_ViewProj;
+    mat4 u_ViewProjInv;
+    mat4 u_ShadowMVP[3]; // SHADOW_CASCADES of them
+    vec4 u_CameraPos;
+    vec4 u_LightDir;
+    float u_Time;
+};
 
 uniform vec4 u_Color;       // When drawing the cube instance, we'll set our uniform color to represent different block types.
 
-uniform mat4 u_DepthBiasMVP;
-
 in vec4 vs_Pos;             // The array of vertex positions passed to the shader
 
 in vec4 vs_Nor;             // The array of vertex normals passed to the shader
@@ -37,12 +42,6 @@ out vec4 fs_Nor;            // The array of normals that has been transformed by
 out vec4 fs_LightVec;       // The direction in which our virtual light lies, relative to each vertex. This is implicitly passed to the fragment shader.
 // out vec4 fs_Col;            // The color of each vertex. This is implicitly passed to the fragment shader.
 out vec4 fs_UV;
-out vec4 fs_ShadowPos;
-
-uniform vec3 lightDir;  // The direction of our virtual light, which is used to compute the shading of
-                                        // the geometry in the fragment shader.
-
-uniform float u_Time;
 
 void main()
 {
@@ -79,10 +78,8 @@ void main()
 
     vec4 modelposition = u_Model * vec4(position, 1.0);   // Temporarily store the transformed vertex positions for use below
 
-    fs_LightVec = vec4(normalize(lightDir), 0.0);  // Compute the direction in which the light source lies
+    fs_LightVec = vec4(u_LightDir.xyz, 0.0);  // Compute the direction in which the light source lies
 
     gl_Position = u_ViewProj * modelposition;// gl_Position is a built-in variable of OpenGL which is
                                              // used to render the final positions of the geometry's vertices
-
-    fs_ShadowPos = u_DepthBiasMVP * vs_Pos;
 }
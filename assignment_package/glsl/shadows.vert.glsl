@@ -6,10 +6,10 @@ in vec4 vs_UV;
 
 out vec4 fs_UV;
 
-uniform mat4 u_DepthMVP;
+uniform mat4 u_LightViewProj; // The shadow cascade being rendered
 
 void main()
 {
-    gl_Position = u_DepthMVP * vs_Pos;
+    gl_Position = u_LightViewProj * vs_Pos;
     fs_UV = vs_UV;
 }
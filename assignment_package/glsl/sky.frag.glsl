@@ -3,10 +3,16 @@
 in vec4 fs_Pos;
 out vec4 out_Col;
 
-uniform mat4 u_ViewProjInv;
-
-uniform vec3 u_CameraPos;
-uniform float u_Time;
+// Filled once a frame and shared by every scene shader. Matches
+// FrameUniforms in shaderprogram.h.
+layout(std140) uniform FrameData {
+    mat4 u_ViewProj;
+    mat4 u_ViewProjInv;
+    mat4 u_ShadowMVP[3]; // SHADOW_CASCADES of them
+    vec4 u_CameraPos;
+    vec4 u_LightDir;
+    float u_Time;
+};
 uniform vec2 u_Resolution;
 
 const float PI = 3.14159265359;
@@ -222,7 +228,7 @@ vec3 sunEffect(vec3 rayDir, vec3 sunDir, vec3 sunBaseColor) {
 vec3 rayDirection(vec4 screenPos) {
     vec4 worldPos = u_ViewProjInv * screenPos;  // convert to world space
     worldPos /= worldPos.w;  // convert from homogeneous coordinates
-    return normalize(worldPos.xyz - u_CameraPos); // direction vector from camera to screen position
+    return normalize(worldPos.xyz - u_CameraPos.xyz); // direction vector from camera to screen position
 }
 
 // inspo from reddit channel and https://www.shadertoy.com/view/3dSXWt
@@ -0,0 +1,261 @@
+#include "chunkrenderer.h"
+#include "shaderprogram.h"
+#include <QOpenGLContext>
+#include <algorithm>
+#include <iterator>
+#include <iostream>
+
+// Each vertex is a position, a normal and a UV, one vec4 apiece
+static constexpr int VERTEX_BYTES = 3 * sizeof(glm::vec4);
+// What the pools start out holding before they first have to grow
+static constexpr int INITIAL_VERTICES = 1 << 18;
+static constexpr int INITIAL_INDICES = 3 << 18;
+
+RangeAllocator::RangeAllocator()
+    : m_free(), m_capacity(0), m_used(0)
+{}
+
+int RangeAllocator::allocate(int size) {
+    if (size <= 0) {
+        return 0;
+    }
+    for (auto it = m_free.begin(); it != m_free.end(); ++it) {
+        if (it->second >= size) {
+            int offset = it->first;
+            int left = it->second - size;
+            m_free.erase(it);
+            if (left > 0) {
+                m_free[offset + size] = left;
+            }
+            m_used += size;
+            return offset;
+        }
+    }
+    return -1;
+}
+
+void RangeAllocator::release(int offset, int size) {
+    if (size <= 0) {
+        return;
+    }
+    m_used -= size;
+    auto next = m_free.lower_bound(offset);
+    if (next != m_free.end() && next->first == offset + size) {
+        size += next->second;
+        next = m_free.erase(next);
+    }
+    if (next != m_free.begin()) {
+        auto prev = std::prev(next);
+        if (prev->first + prev->second == offset) {
+            prev->second += size;
+            return;
+        }
+    }
+    m_free[offset] = size;
+}
+
+void RangeAllocator::grow(int capacity) {
+    if (capacity <= m_capacity) {
+        return;
+    }
+    int old = m_capacity;
+    m_capacity = capacity;
+    // Put back as though it had been allocated, so it joins a free range
+    // running up to the old end
+    m_used += capacity - old;
+    release(old, capacity - old);
+}
+
+int RangeAllocator::capacity() const {
+    return m_capacity;
+}
+
+int RangeAllocator::used() const {
+    return m_used;
+}
+
+
+ChunkRenderer::ChunkRenderer(OpenGLContext *context)
+    : mp_context(context), m_opq(), m_trans(), m_commandBuffer(0),
+      m_multiDrawIndirect(nullptr), m_multiDrawBaseVertex(nullptr),
+      m_counts(), m_offsets(), m_baseVertices(), m_stats()
+{
+    // Neither entry point is in QOpenGLExtraFunctions, which stops at
+    // what OpenGL ES has
+    QOpenGLContext *ctx = context->context();
+    QSurfaceFormat format = ctx->format();
+    bool hasIndirect = format.majorVersion() > 4 || (format.majorVersion() == 4 && format.minorVersion() >= 3)
+                       || ctx->hasExtension("GL_ARB_multi_draw_indirect");
+    if (hasIndirect) {
+        m_multiDrawIndirect = reinterpret_cast<MultiDrawIndirect>(ctx->getProcAddress("glMultiDrawElementsIndirect"));
+    }
+    m_multiDrawBaseVertex = reinterpret_cast<MultiDrawBaseVertex>(ctx->getProcAddress("glMultiDrawElementsBaseVertex"));
+    std::cout << "Chunk draws: " << (m_multiDrawIndirect != nullptr ? "glMultiDrawElementsIndirect"
+                                     : m_multiDrawBaseVertex != nullptr ? "glMultiDrawElementsBaseVertex"
+                                     : "one per Chunk") << std::endl;
+
+    for (Pool *pool : {&m_opq, &m_trans}) {
+        mp_context->glGenBuffers(1, &pool->verts);
+        mp_context->glGenBuffers(1, &pool->indices);
+        mp_context->glBindBuffer(GL_COPY_WRITE_BUFFER, pool->verts);
+        mp_context->glBufferData(GL_COPY_WRITE_BUFFER, size_t(INITIAL_VERTICES) * VERTEX_BYTES, nullptr, GL_STATIC_DRAW);
+        mp_context->glBindBuffer(GL_COPY_WRITE_BUFFER, pool->indices);
+        mp_context->glBufferData(GL_COPY_WRITE_BUFFER, size_t(INITIAL_INDICES) * sizeof(GLuint), nullptr, GL_STATIC_DRAW);
+        pool->vertSpace.grow(INITIAL_VERTICES);
+        pool->indexSpace.grow(INITIAL_INDICES);
+        mp_context->glGenVertexArrays(1, &pool->vao);
+        setUpInterleavedVAO(mp_context, pool->vao, pool->verts, pool->indices);
+    }
+    mp_context->glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    mp_context->glGenBuffers(1, &m_commandBuffer);
+}
+
+ChunkRenderer::~ChunkRenderer() {
+    for (Pool *pool : {&m_opq, &m_trans}) {
+        mp_context->glDeleteBuffers(1, &pool->verts);
+        mp_context->glDeleteBuffers(1, &pool->indices);
+        mp_context->glDeleteVertexArrays(1, &pool->vao);
+    }
+    mp_context->glDeleteBuffers(1, &m_commandBuffer);
+}
+
+bool ChunkRenderer::isValid() const {
+    return m_multiDrawIndirect != nullptr || m_multiDrawBaseVertex != nullptr;
+}
+
+int ChunkRenderer::place(GLuint &buffer, RangeAllocator &space, int unitBytes, GLuint src, int count) {
+    int offset = space.allocate(count);
+    if (offset < 0) {
+        // Double it, or more if that still isn't enough, and move the
+        // old contents across without them leaving the GPU
+        int capacity = std::max(2 * space.capacity(), space.capacity() + count);
+        GLuint bigger;
+        mp_context->glGenBuffers(1, &bigger);
+        mp_context->glBindBuffer(GL_COPY_WRITE_BUFFER, bigger);
+        mp_context->glBufferData(GL_COPY_WRITE_BUFFER, size_t(capacity) * unitBytes, nullptr, GL_STATIC_DRAW);
+        mp_context->glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+        mp_context->glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, size_t(space.capacity()) * unitBytes);
+        mp_context->glDeleteBuffers(1, &buffer);
+        buffer = bigger;
+        space.grow(capacity);
+        offset = space.allocate(count);
+    }
+    if (count > 0) {
+        mp_context->glBindBuffer(GL_COPY_READ_BUFFER, src);
+        mp_context->glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+        mp_context->glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, size_t(offset) * unitBytes,
+                                        size_t(count) * unitBytes);
+    }
+    return offset;
+}
+
+void ChunkRenderer::storeIn(Pool &pool, const Chunk *c, GLuint verts, int vertexCount, GLuint indices, int indexCount) {
+    auto old = pool.meshes.find(c);
+    if (old != pool.meshes.end()) {
+        pool.vertSpace.release(old->second.firstVertex, old->second.vertexCount);
+        pool.indexSpace.release(old->second.firstIndex, old->second.indexCount);
+    }
+    Slot &slot = pool.meshes[c];
+    slot.vertexCount = vertexCount;
+    slot.indexCount = indexCount;
+    GLuint oldVerts = pool.verts, oldIndices = pool.indices;
+    slot.firstVertex = place(pool.verts, pool.vertSpace, VERTEX_BYTES, verts, vertexCount);
+    slot.firstIndex = place(pool.indices, pool.indexSpace, sizeof(GLuint), indices, indexCount);
+    if (pool.verts != oldVerts || pool.indices != oldIndices) {
+        setUpInterleavedVAO(mp_context, pool.vao, pool.verts, pool.indices);
+    }
+}
+
+void ChunkRenderer::store(const Chunk *c, const ChunkBuffers &buffers) {
+    // The vertex counts in ChunkBuffers are in vec4s
+    storeIn(m_opq, c, buffers.opqVerts, buffers.opqVertCount / 3, buffers.opqIndices, buffers.opqIndexCount);
+    storeIn(m_trans, c, buffers.transVerts, buffers.transVertCount / 3, buffers.transIndices, buffers.transIndexCount);
+    mp_context->glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    mp_context->glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+}
+
+void ChunkRenderer::remove(const Chunk *c) {
+    for (Pool *pool : {&m_opq, &m_trans}) {
+        auto it = pool->meshes.find(c);
+        if (it != pool->meshes.end()) {
+            pool->vertSpace.release(it->second.firstVertex, it->second.vertexCount);
+            pool->indexSpace.release(it->second.firstIndex, it->second.indexCount);
+            pool->meshes.erase(it);
+        }
+    }
+}
+
+void ChunkRenderer::queue(const Chunk *c, bool transparent, int first, int count) {
+    Pool &pool = transparent ? m_trans : m_opq;
+    auto it = pool.meshes.find(c);
+    if (it == pool.meshes.end()) {
+        return;
+    }
+    const Slot &slot = it->second;
+    if (count < 0) {
+        count = slot.indexCount - first;
+    }
+    if (count <= 0) {
+        return;
+    }
+    pool.commands.push_back({static_cast<GLuint>(count), 1, static_cast<GLuint>(slot.firstIndex + first), slot.firstVertex, 0});
+}
+
+void ChunkRenderer::flush(ShaderProgram &prog, bool transparent) {
+    Pool &pool = transparent ? m_trans : m_opq;
+    if (pool.commands.empty()) {
+        return;
+    }
+    prog.useMe();
+    // Left bound, as ShaderProgram leaves a Drawable's VAO
+    mp_context->glBindVertexArray(pool.vao);
+
+    GLsizei drawCount = static_cast<GLsizei>(pool.commands.size());
+    if (m_multiDrawIndirect != nullptr) {
+        mp_context->glBindBuffer(GL_DRAW_INDIRECT_BUFFER, m_commandBuffer);
+        mp_context->glBufferData(GL_DRAW_INDIRECT_BUFFER, pool.commands.size() * sizeof(DrawCommand),
+                                 pool.commands.data(), GL_STREAM_DRAW);
+        m_multiDrawIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, nullptr, drawCount, 0);
+        mp_context->glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    } else {
+        m_counts.clear();
+        m_offsets.clear();
+        m_baseVertices.clear();
+        for (const DrawCommand &cmd : pool.commands) {
+            m_counts.push_back(cmd.count);
+            m_offsets.push_back(reinterpret_cast<const void*>(size_t(cmd.firstIndex) * sizeof(GLuint)));
+            m_baseVertices.push_back(cmd.baseVertex);
+        }
+        m_multiDrawBaseVertex(GL_TRIANGLES, m_counts.data(), GL_UNSIGNED_INT, m_offsets.data(), drawCount,
+                              m_baseVertices.data());
+    }
+    m_stats.commands += drawCount;
+    m_stats.drawCalls++;
+    pool.commands.clear();
+
+    mp_context->printGLErrorLog();
+}
+
+const ChunkRenderStats& ChunkRenderer::stats() const {
+    return m_stats;
+}
+
+void ChunkRenderer::resetStats() {
+    m_stats = ChunkRenderStats();
+}
+
+size_t ChunkRenderer::bytesUsed() const {
+    size_t bytes = 0;
+    for (const Pool *pool : {&m_opq, &m_trans}) {
+        bytes += size_t(pool->vertSpace.used()) * VERTEX_BYTES + size_t(pool->indexSpace.used()) * sizeof(GLuint);
+    }
+    return bytes;
+}
+
+size_t ChunkRenderer::bytesAllocated() const {
+    size_t bytes = 0;
+    for (const Pool *pool : {&m_opq, &m_trans}) {
+        bytes += size_t(pool->vertSpace.capacity()) * VERTEX_BYTES + size_t(pool->indexSpace.capacity()) * sizeof(GLuint);
+    }
+    return bytes;
+}
@@ -0,0 +1,119 @@
+#pragma once
+#include "openglcontext.h"
+#include "scene/chunk.h"
+#include <map>
+#include <unordered_map>
+#include <vector>
+
+class ShaderProgram;
+
+// Hands out ranges of [0, capacity()), first fit, merging released
+// ranges back into their free neighbours. Sizes are in whatever unit the
+// caller counts in.
+class RangeAllocator {
+private:
+    std::map<int, int> m_free; // Offset -> size of each free range
+    int m_capacity;
+    int m_used;
+
+public:
+    RangeAllocator();
+
+    // The offset of a free range of size units, or -1 if none is that big
+    int allocate(int size);
+    void release(int offset, int size);
+    // Adds [capacity(), capacity) to the free space
+    void grow(int capacity);
+    int capacity() const;
+    int used() const;
+};
+
+// Counted since the last resetStats()
+struct ChunkRenderStats {
+    int commands = 0;  // Index ranges drawn
+    int drawCalls = 0; // Multi-draws they went out in
+};
+
+// Keeps every Chunk's mesh in a few large shared buffers, a vertex and an
+// index buffer each for opaque and transparent faces, so all the ranges
+// queued for a pass go out in one multi-draw however many Chunks they
+// come from. Uses glMultiDrawElementsIndirect where the driver has it
+// and glMultiDrawElementsBaseVertex otherwise.
+//
+// Meshes still reach the GPU through their Chunk's own buffers; store()
+// copies them into place GPU-side, after which the Chunk's buffers can go.
+// Everything here runs on the main thread with its context current.
+class ChunkRenderer {
+public:
+    // Laid out the way glMultiDrawElementsIndirect reads it
+    struct DrawCommand {
+        GLuint count;
+        GLuint instanceCount;
+        GLuint firstIndex;
+        GLint baseVertex;
+        GLuint baseInstance;
+    };
+
+private:
+    // Where one Chunk's mesh sits in a Pool, in vertices and indices
+    struct Slot {
+        int firstVertex, vertexCount;
+        int firstIndex, indexCount;
+    };
+
+    struct Pool {
+        GLuint verts, indices;
+        GLuint vao; // Set up again whenever either buffer grows
+        RangeAllocator vertSpace, indexSpace;
+        std::unordered_map<const Chunk*, Slot> meshes;
+        std::vector<DrawCommand> commands; // Queued for the next flush()
+    };
+
+    using MultiDrawIndirect = void (QOPENGLF_APIENTRYP)(GLenum, GLenum, const void*, GLsizei, GLsizei);
+    using MultiDrawBaseVertex = void (QOPENGLF_APIENTRYP)(GLenum, const GLsizei*, GLenum, const void* const*, GLsizei, const GLint*);
+
+    OpenGLContext *mp_context; // Not owned
+    Pool m_opq, m_trans;
+    GLuint m_commandBuffer;
+    MultiDrawIndirect m_multiDrawIndirect;     // Null without GL 4.3 or ARB_multi_draw_indirect
+    MultiDrawBaseVertex m_multiDrawBaseVertex; // Any 3.2 core context has this
+    // Scratch for the glMultiDrawElementsBaseVertex path
+    std::vector<GLsizei> m_counts;
+    std::vector<const void*> m_offsets;
+    std::vector<GLint> m_baseVertices;
+    ChunkRenderStats m_stats;
+
+    // Places count units of src at a fresh range of the pool's buffer,
+    // growing it if it's full, and returns where they went
+    int place(GLuint &buffer, RangeAllocator &space, int unitBytes, GLuint src, int count);
+    void storeIn(Pool &pool, const Chunk *c, GLuint verts, int vertexCount, GLuint indices, int indexCount);
+
+public:
+    // Call once the context is initialized
+    ChunkRenderer(OpenGLContext *context);
+    // Call with the context current
+    ~ChunkRenderer();
+    ChunkRenderer(const ChunkRenderer&) = delete;
+    ChunkRenderer& operator=(const ChunkRenderer&) = delete;
+
+    // False if the context can't multi-draw; draw Chunk by Chunk instead
+    bool isValid() const;
+
+    // Copies the mesh in buffers into the pools, replacing whatever c had
+    // there before. The buffers themselves are left alone.
+    void store(const Chunk *c, const ChunkBuffers &buffers);
+    // Frees c's mesh's space for others, before c is deleted
+    void remove(const Chunk *c);
+    // Adds count indices of c's opaque or transparent mesh, from index
+    // first on, to the next flush(); by default, all of them
+    void queue(const Chunk *c, bool transparent, int first = 0, int count = -1);
+    // Draws everything queued for the opaque or transparent pool with
+    // prog in one call
+    void flush(ShaderProgram &prog, bool transparent);
+
+    const ChunkRenderStats& stats() const;
+    void resetStats();
+    // Bytes of the pools in use by meshes, and allocated in total
+    size_t bytesUsed() const;
+    size_t bytesAllocated() const;
+};
@@ -55,6 +55,28 @@ bool Drawable::bindBuffer(BufferType buf) {
     return bufGenerated[buf];
 }
 
+GLuint Drawable::vertexArray(BufferType) const {
+    return 0;
+}
+
+void setUpInterleavedVAO(OpenGLContext *context, GLuint vao, GLuint verts, GLuint indices) {
+    GLint previous;
+    context->glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &previous);
+    context->glBindVertexArray(vao);
+
+    const GLsizei stride = 3 * sizeof(glm::vec4);
+    context->glBindBuffer(GL_ARRAY_BUFFER, verts);
+    context->glEnableVertexAttribArray(ATTRIB_POS);
+    context->glVertexAttribPointer(ATTRIB_POS, 4, GL_FLOAT, false, stride, (void*)0);
+    context->glEnableVertexAttribArray(ATTRIB_NOR);
+    context->glVertexAttribPointer(ATTRIB_NOR, 4, GL_FLOAT, false, stride, (void*)sizeof(glm::vec4));
+    context->glEnableVertexAttribArray(ATTRIB_UV);
+    context->glVertexAttribPointer(ATTRIB_UV, 4, GL_FLOAT, false, stride, (void*)(2 * sizeof(glm::vec4)));
+    context->glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices);
+
+    context->glBindVertexArray(previous);
+}
+
 InstancedDrawable::InstancedDrawable(OpenGLContext *context)
     : Drawable(context), m_numInstances(0)
 {}
@@ -13,6 +13,16 @@ enum BufferType : unsigned char {
     INSTANCED_OFFSET
 };
 
+// The locations ShaderProgram binds the interleaved vertex attributes
+// to in every program, so a VAO set up once draws with any of them
+enum VertexAttrib : GLuint {
+    ATTRIB_POS, ATTRIB_NOR, ATTRIB_UV
+};
+
+// Sets up vao to read positions, normals and UVs from the interleaved
+// buffer verts and indices from indices. Leaves the bound VAO as it was.
+void setUpInterleavedVAO(OpenGLContext *context, GLuint vao, GLuint verts, GLuint indices);
+
 //This defines a class which can be rendered by our shader program.
 //Make any geometry a subclass of ShaderProgram::Drawable in order to render it with the ShaderProgram class.
 class Drawable
@@ -45,6 +55,10 @@ public:
     void generateBuffer(BufferType buf);
 
     bool bindBuffer(BufferType buf);
+
+    // A VAO holding all the state needed to draw the given index buffer,
+    // or 0 if the attributes have to be set up on every draw
+    virtual GLuint vertexArray(BufferType indexBuf) const;
 };
 
 
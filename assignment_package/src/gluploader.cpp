@@ -0,0 +1,108 @@
+#include "gluploader.h"
+#include <QOffscreenSurface>
+#include <QOpenGLContext>
+#include <iostream>
+
+GLUploader::GLUploader(OpenGLContext *context)
+    : mp_context(context), m_surface(mkU<QOffscreenSurface>()), m_thread(),
+      m_mutex(), m_cv(), m_pending(), m_started(false), m_valid(false), m_stopping(false),
+      m_finished(), m_waiting(), m_inFlight(0)
+{
+    // A surface has to be created on the GUI thread, but the context
+    // that uses it is made on the upload thread, which it then belongs to
+    QOpenGLContext *share = context->context();
+    m_surface->setFormat(share->format());
+    m_surface->create();
+    m_thread = std::thread(&GLUploader::run, this, share);
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_cv.wait(lock, [this]() { return m_started; });
+}
+
+GLUploader::~GLUploader() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_cv.notify_all();
+    m_thread.join();
+
+    m_finished.drain(m_waiting);
+    for (Finished &f : m_waiting) {
+        mp_context->glDeleteSync(f.fence);
+        GLuint handles[4] = {f.buffers.opqVerts, f.buffers.opqIndices, f.buffers.transVerts, f.buffers.transIndices};
+        mp_context->glDeleteBuffers(4, handles);
+    }
+    m_surface->destroy();
+}
+
+void GLUploader::run(QOpenGLContext *share) {
+    QOpenGLContext context;
+    context.setFormat(share->format());
+    context.setShareContext(share);
+    bool valid = context.create() && context.makeCurrent(m_surface.get());
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_started = true;
+        m_valid = valid;
+    }
+    m_cv.notify_all();
+    if (!valid) {
+        std::cout << "Could not make a shared GL context for uploads" << std::endl;
+        return;
+    }
+
+    QOpenGLExtraFunctions gl(&context);
+    while (true) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cv.wait(lock, [this]() { return m_stopping || !m_pending.empty(); });
+        if (m_stopping) {
+            break;
+        }
+        Chunk *c = m_pending.front();
+        m_pending.pop_front();
+        lock.unlock();
+
+        ChunkBuffers buffers = c->createBuffers(&gl);
+        GLsync fence = gl.glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        // Without a flush the fence might never reach the GPU, and the
+        // main context would wait on it forever
+        gl.glFlush();
+        m_finished.push({c, buffers, fence});
+    }
+    context.doneCurrent();
+}
+
+bool GLUploader::isValid() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_valid;
+}
+
+void GLUploader::upload(Chunk *c) {
+    m_inFlight++;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_pending.push_back(c);
+    }
+    m_cv.notify_one();
+}
+
+void GLUploader::collect(std::vector<Finished> &out) {
+    m_finished.drain(m_waiting);
+    size_t kept = 0;
+    for (Finished &f : m_waiting) {
+        // A timeout of 0 just polls the fence
+        if (mp_context->glClientWaitSync(f.fence, 0, 0) == GL_TIMEOUT_EXPIRED) {
+            m_waiting[kept++] = f;
+            continue;
+        }
+        mp_context->glDeleteSync(f.fence);
+        out.push_back(f);
+        m_inFlight--;
+    }
+    m_waiting.resize(kept);
+}
+
+size_t GLUploader::inFlight() const {
+    return m_inFlight;
+}
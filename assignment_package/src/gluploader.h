@@ -0,0 +1,63 @@
+#pragma once
+#include "openglcontext.h"
+#include "mpscqueue.h"
+#include "smartpointerhelp.h"
+#include "scene/chunk.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class QOffscreenSurface;
+
+// Uploads Chunk meshes from a thread of its own, through a GL context
+// that shares objects with the main one, so glBufferData never stalls
+// drawing. Each upload is followed by a fence; collect() only hands back
+// uploads whose fence has signalled, whose buffers the main context can
+// then draw from straight away.
+//
+// A Chunk handed to upload() must keep its mesh until it comes back out
+// of collect().
+class GLUploader {
+public:
+    struct Finished {
+        Chunk *chunk;
+        ChunkBuffers buffers;
+        GLsync fence;
+    };
+
+private:
+    OpenGLContext *mp_context; // The main context. Not owned.
+    uPtr<QOffscreenSurface> m_surface;
+    std::thread m_thread;
+
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<Chunk*> m_pending; // Guarded by m_mutex
+    bool m_started, m_valid, m_stopping; // Guarded by m_mutex
+
+    MPSCQueue<Finished> m_finished;
+    std::vector<Finished> m_waiting; // Uploaded, fence not yet signalled. Main thread only.
+    std::atomic<size_t> m_inFlight;
+
+    void run(QOpenGLContext *share);
+
+public:
+    // Call from the main thread once context is initialized
+    GLUploader(OpenGLContext *context);
+    // Call with the main context current; frees anything never collected
+    ~GLUploader();
+    GLUploader(const GLUploader&) = delete;
+    GLUploader& operator=(const GLUploader&) = delete;
+
+    // False if no shared context could be made; upload on the main thread instead
+    bool isValid();
+    void upload(Chunk *c);
+    // Appends every upload that has finished on the GPU to out. Call from
+    // the main thread with its context current.
+    void collect(std::vector<Finished> &out);
+    // Handed to upload() but not yet returned by collect()
+    size_t inFlight() const;
+};
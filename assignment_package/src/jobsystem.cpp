@@ -0,0 +1,213 @@
+#include "jobsystem.h"
+#include <algorithm>
+#include <limits>
+#include <memory>
+
+// Which JobSystem the calling thread works for, and its queue there
+static thread_local const JobSystem *t_owner = nullptr;
+static thread_local int t_workerIndex = -1;
+
+JobSystem::JobSystem(int workerCount)
+    : m_workers(), m_queues(), m_queued(0), m_nextQueue(0),
+      m_mutex(), m_cv(), m_stopping(false),
+      m_focusMutex(), m_focus{glm::vec2(0.f), glm::vec2(0.f)},
+      m_peakQueued(0), m_completed(0), m_stolen(0),
+      m_waitNanos(0), m_maxWaitNanos(0), m_runNanos(0), m_maxRunNanos(0)
+{
+    workerCount = std::max(1, workerCount);
+    for (int i = 0; i < workerCount; i++) {
+        m_queues.push_back(mkU<WorkerQueue>());
+    }
+    for (int i = 0; i < workerCount; i++) {
+        m_workers.emplace_back(&JobSystem::workerLoop, this, i);
+    }
+}
+
+JobSystem::~JobSystem() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_cv.notify_all();
+    for (auto &t : m_workers) {
+        t.join();
+    }
+}
+
+int JobSystem::defaultWorkerCount() {
+    return std::max(1, static_cast<int>(std::thread::hardware_concurrency()) - 1);
+}
+
+// Lower is more urgent. Distance is stretched up to three times for
+// jobs directly behind the focus, so the ring in front of the player
+// finishes well before the one behind it.
+static float urgency(const glm::vec2 &position, const glm::vec2 &focusPos, const glm::vec2 &look) {
+    glm::vec2 offset = position - focusPos;
+    float dist = glm::length(offset);
+    if (dist < 1e-3f) {
+        return 0.f;
+    }
+    float facing = glm::dot(offset / dist, look); // 1 ahead, -1 behind
+    return dist * (2.f - facing);
+}
+
+bool JobSystem::takeFrom(int from, const Focus &focus, QueuedJob &out) {
+    WorkerQueue &q = *m_queues[from];
+    std::lock_guard<std::mutex> lock(q.mutex);
+    if (q.jobs.empty()) {
+        return false;
+    }
+    size_t best = 0;
+    float bestScore = std::numeric_limits<float>::max();
+    for (size_t i = 0; i < q.jobs.size(); i++) {
+        const QueuedJob &j = q.jobs[i];
+        float s = j.hasPosition ? urgency(j.position, focus.position, focus.look) : -1.f;
+        if (s < bestScore) {
+            bestScore = s;
+            best = i;
+        }
+    }
+    out = std::move(q.jobs[best]);
+    q.jobs.erase(q.jobs.begin() + best);
+    m_queued--;
+    return true;
+}
+
+bool JobSystem::takeJob(int index, QueuedJob &out, bool &stolen) {
+    Focus focus;
+    {
+        std::lock_guard<std::mutex> lock(m_focusMutex);
+        focus = m_focus;
+    }
+    stolen = false;
+    if (takeFrom(index, focus, out)) {
+        return true;
+    }
+    const int n = static_cast<int>(m_queues.size());
+    for (int i = 1; i < n; i++) {
+        if (takeFrom((index + i) % n, focus, out)) {
+            stolen = true;
+            return true;
+        }
+    }
+    return false;
+}
+
+void JobSystem::workerLoop(int index) {
+    t_owner = this;
+    t_workerIndex = index;
+    while (true) {
+        QueuedJob job;
+        bool stolen;
+        if (!takeJob(index, job, stolen)) {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cv.wait(lock, [this]() { return m_stopping || m_queued > 0; });
+            if (m_queued == 0) {
+                return;
+            }
+            continue;
+        }
+
+        Clock::time_point start = Clock::now();
+        job.run();
+        Clock::time_point end = Clock::now();
+
+        int64_t wait = std::chrono::duration_cast<std::chrono::nanoseconds>(start - job.pushed).count();
+        int64_t run = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_completed++;
+        m_stolen += stolen ? 1 : 0;
+        m_waitNanos += wait;
+        m_maxWaitNanos = std::max(m_maxWaitNanos, wait);
+        m_runNanos += run;
+        m_maxRunNanos = std::max(m_maxRunNanos, run);
+    }
+}
+
+void JobSystem::enqueue(QueuedJob job) {
+    // Workers keep what they spawn; everyone else spreads jobs round-robin
+    int index = (t_owner == this) ? t_workerIndex : static_cast<int>(m_nextQueue++ % m_queues.size());
+    // Counted before it's visible, so a worker can never take it first
+    // and take the count below zero
+    size_t queued = ++m_queued;
+    {
+        WorkerQueue &q = *m_queues[index];
+        std::lock_guard<std::mutex> lock(q.mutex);
+        q.jobs.push_back(std::move(job));
+    }
+    {
+        // Taking the lock orders this push against a worker about to sleep
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_peakQueued = std::max(m_peakQueued, queued);
+    }
+    m_cv.notify_one();
+}
+
+void JobSystem::push(std::function<void()> job) {
+    enqueue({std::move(job), Clock::now(), false, glm::vec2(0.f)});
+}
+
+void JobSystem::push(std::function<void()> job, glm::vec2 position) {
+    enqueue({std::move(job), Clock::now(), true, position});
+}
+
+void JobSystem::setFocus(glm::vec2 position, glm::vec2 look) {
+    float len = glm::length(look);
+    std::lock_guard<std::mutex> lock(m_focusMutex);
+    m_focus.position = position;
+    m_focus.look = len > 1e-4f ? look / len : glm::vec2(0.f);
+}
+
+void JobSystem::parallelFor(int n, const std::function<void(int)> &body) {
+    // Helpers that start after every index is taken return at once, but
+    // may do so after we have; whatever they touch lives in the Batch
+    struct Batch {
+        std::function<void(int)> body;
+        int n;
+        std::atomic<int> next{0}, done{0};
+        std::mutex mutex;
+        std::condition_variable cv;
+    };
+    auto batch = std::make_shared<Batch>();
+    batch->body = body;
+    batch->n = n;
+    auto work = [batch]() {
+        int i;
+        while ((i = batch->next++) < batch->n) {
+            batch->body(i);
+            if (++batch->done == batch->n) {
+                std::lock_guard<std::mutex> lock(batch->mutex);
+                batch->cv.notify_all();
+            }
+        }
+    };
+
+    // Without a position the helpers go ahead of everything else queued
+    int helpers = std::min(n - 1, workerCount());
+    for (int h = 0; h < helpers; h++) {
+        push(work);
+    }
+    work();
+    // Only indices already taken are left, and each is running somewhere
+    std::unique_lock<std::mutex> lock(batch->mutex);
+    batch->cv.wait(lock, [&batch]() { return batch->done == batch->n; });
+}
+
+int JobSystem::workerCount() const {
+    return static_cast<int>(m_workers.size());
+}
+
+JobStats JobSystem::stats() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    JobStats s;
+    s.queued = m_queued;
+    s.peakQueued = m_peakQueued;
+    s.completed = m_completed;
+    s.stolen = m_stolen;
+    double n = m_completed > 0 ? static_cast<double>(m_completed) : 1.0;
+    s.meanWaitMs = m_waitNanos / n / 1e6;
+    s.maxWaitMs = m_maxWaitNanos / 1e6;
+    s.meanRunMs = m_runNanos / n / 1e6;
+    s.maxRunMs = m_maxRunNanos / 1e6;
+    return s;
+}
@@ -0,0 +1,103 @@
+#pragma once
+#include "glm_includes.h"
+#include "smartpointerhelp.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A snapshot of how busy a JobSystem is. Latencies are totals since it
+// was created.
+struct JobStats {
+    size_t queued;       // jobs waiting for a worker right now
+    size_t peakQueued;   // the most that have ever been waiting at once
+    int64_t completed;
+    int64_t stolen;      // jobs a worker took from another worker's queue
+    double meanWaitMs;   // from push() until a worker picked the job up
+    double maxWaitMs;
+    double meanRunMs;    // time spent running the job itself
+    double maxRunMs;
+};
+
+// A fixed set of worker threads, each with its own job queue. A worker
+// takes the most urgent job from its own queue and, once that is empty,
+// steals the most urgent job from another worker's.
+//
+// Jobs pushed with a world-space (x, z) position are ordered by distance
+// to the focus set with setFocus(), weighted so that jobs in front of the
+// focus come before jobs the same distance behind it. Urgency is worked
+// out when a job is picked, not when it is pushed, so moving the focus
+// reorders everything already queued. Jobs without a position go first.
+//
+// Jobs still queued when the JobSystem is destroyed are run before
+// the workers exit.
+class JobSystem {
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct QueuedJob {
+        std::function<void()> run;
+        Clock::time_point pushed;
+        bool hasPosition;
+        glm::vec2 position;
+    };
+
+    struct WorkerQueue {
+        std::mutex mutex;
+        std::deque<QueuedJob> jobs;
+    };
+
+    struct Focus {
+        glm::vec2 position;
+        glm::vec2 look; // unit length, or zero for no preferred direction
+    };
+
+    std::vector<std::thread> m_workers;
+    std::vector<uPtr<WorkerQueue>> m_queues;
+    std::atomic<size_t> m_queued;
+    std::atomic<unsigned int> m_nextQueue; // round-robin target for pushes from outside the pool
+
+    // Guards m_stopping and the statistics; workers sleep on m_cv
+    mutable std::mutex m_mutex;
+    std::condition_variable m_cv;
+    bool m_stopping;
+
+    mutable std::mutex m_focusMutex;
+    Focus m_focus;
+
+    size_t m_peakQueued;
+    int64_t m_completed, m_stolen;
+    int64_t m_waitNanos, m_maxWaitNanos;
+    int64_t m_runNanos, m_maxRunNanos;
+
+    void workerLoop(int index);
+    // Takes the most urgent job from queue `from`. Returns false if it's empty.
+    bool takeFrom(int from, const Focus &focus, QueuedJob &out);
+    bool takeJob(int index, QueuedJob &out, bool &stolen);
+    void enqueue(QueuedJob job);
+
+public:
+    JobSystem(int workerCount);
+    ~JobSystem();
+
+    // One worker per core, leaving one for the main thread
+    static int defaultWorkerCount();
+
+    void push(std::function<void()> job);
+    // A job working on the world around (x, z)
+    void push(std::function<void()> job, glm::vec2 position);
+    // Where the player is and which way they're looking, in the x-z plane
+    void setFocus(glm::vec2 position, glm::vec2 look);
+    // Runs body(0) ... body(n - 1) across the workers and the calling
+    // thread, and returns once all have finished. The caller works through
+    // the indices too, so this is safe to call from inside a job.
+    void parallelFor(int n, const std::function<void(int)> &body);
+
+    int workerCount() const;
+    JobStats stats() const;
+};
@@ -1,4 +1,5 @@
 #include <mainwindow.h>
+#include "pregenerate.h"
 
 #include <QApplication>
 #include <QSurfaceFormat>
@@ -27,6 +28,11 @@ void debugFormatVersion()
 
 int main(int argc, char *argv[])
 {
+    // Headless: generate a world to disk and exit without any GL
+    if (isPregenerateRun(argc, argv)) {
+        return runPregeneration(argc, argv);
+    }
+
     QApplication a(argc, argv);
 
     // Set OpenGL 4.0 and, optionally, 4-sample multisampling
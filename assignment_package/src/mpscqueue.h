@@ -0,0 +1,51 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+// A queue any number of threads can push to without taking a lock, and
+// exactly one thread drains. Pushes go onto a lock-free stack; drain()
+// swaps the whole stack out at once and reverses it back into push
+// order. Since the consumer never pops single nodes, there's no ABA.
+template <typename T>
+class MPSCQueue {
+private:
+    struct Node {
+        T value;
+        Node *next;
+    };
+    std::atomic<Node*> m_head;
+
+public:
+    MPSCQueue() : m_head(nullptr) {}
+    ~MPSCQueue() {
+        Node *n = m_head.load();
+        while (n != nullptr) {
+            Node *next = n->next;
+            delete n;
+            n = next;
+        }
+    }
+    MPSCQueue(const MPSCQueue&) = delete;
+    MPSCQueue& operator=(const MPSCQueue&) = delete;
+
+    // Safe from any thread
+    void push(T value) {
+        Node *n = new Node{std::move(value), m_head.load(std::memory_order_relaxed)};
+        while (!m_head.compare_exchange_weak(n->next, n, std::memory_order_release, std::memory_order_relaxed)) {}
+    }
+
+    // Appends everything pushed so far to out, oldest first. Only ever
+    // call from the one consuming thread.
+    void drain(std::vector<T> &out) {
+        Node *n = m_head.exchange(nullptr, std::memory_order_acquire);
+        size_t first = out.size();
+        while (n != nullptr) {
+            out.push_back(std::move(n->value));
+            Node *next = n->next;
+            delete n;
+            n = next;
+        }
+        std::reverse(out.begin() + first, out.end());
+    }
+};
@@ -5,7 +5,6 @@
 #include <QApplication>
 #include <QKeyEvent>
 #include <QDateTime>
-#include <thread>
 #include <QFile>
 
 
@@ -13,15 +12,21 @@ MyGL::MyGL(QWidget *parent)
     : OpenGLContext(parent),
       m_worldAxes(this),
       m_progLambert(this), m_progFlat(this), m_progSky(this), m_progInstanced(this), m_texture(this),
-      m_terrain(this), m_player(glm::vec3(47.f, 164.f, 170.f), m_terrain),
+      m_terrain(this), m_player(PLAYER_SPAWN, m_terrain), m_jobs(JobSystem::defaultWorkerCount()),
       m_quad(this),
       m_inputs(), m_timer(), m_startTime(QDateTime::currentMSecsSinceEpoch()),
-      m_lastTime(QDateTime::currentMSecsSinceEpoch()),
+      m_lastStatsTime(m_startTime), m_teleportTime(-1),
+      m_simThread(), m_simRunning(false), m_simMutex(),
+      m_prevPlayerPos(PLAYER_SPAWN), m_lastStepTime(std::chrono::steady_clock::now()),
+      m_renderDistance(ShadowCascades::DEFAULT_RENDER_DISTANCE), m_shadowRenderDistance(ShadowCascades::DEFAULT_RENDER_DISTANCE),
+      m_renderViewProj(1.f), m_renderCameraPos(PLAYER_SPAWN), m_renderPlayerPos(PLAYER_SPAWN),
+      m_frameTimer(), m_worstFrameMs(0.0), m_totalFrameMs(0.0), m_frames(0), m_frameUploads(0), m_maxFrameUploads(0),
+      m_cascadesRendered(0), m_castersDrawn(0),
       progPostProcess(this),
       postProcessFBO(this, width(), height(), this->devicePixelRatio()),
       quadDrawable(this),
       progShadows(this),
-      shadowFBO(this, 4096/this->devicePixelRatio(), 4096/this->devicePixelRatio(), this->devicePixelRatio())
+      m_shadows(this, 2048), m_meshChanges()
 {
     // Connect the timer to a function so that when the timer ticks the function is executed
     connect(&m_timer, SIGNAL(timeout()), this, SLOT(tick()));
@@ -31,11 +36,39 @@ MyGL::MyGL(QWidget *parent)
 
     setMouseTracking(true); // MyGL will track the mouse's movements even if a mouse button is not pressed
     setCursor(Qt::BlankCursor); // Make the cursor invisible
+
+    m_terrain.setJobLauncher([this](glm::vec2 where, std::function<void()> job) { m_jobs.push(std::move(job), where); });
+    m_terrain.setParallelFor([this](int n, const std::function<void(int)> &body) { m_jobs.parallelFor(n, body); });
+    // Enough zones queued to keep every worker busy, but few enough that
+    // turning around doesn't leave a backlog behind us
+    m_terrain.setMaxZonesInFlight(2 * m_jobs.workerCount());
+
+    // Play on a world written by --pregenerate, if one was given
+    QStringList args = QCoreApplication::arguments();
+    int worldArg = args.indexOf("--world");
+    if (worldArg >= 0 && worldArg + 1 < args.size()) {
+        m_worldStore = mkU<WorldStore>(args[worldArg + 1].toStdString());
+        m_terrain.setWorldStore(m_worldStore.get());
+    }
+    int distanceArg = args.indexOf("--render-distance");
+    if (distanceArg >= 0 && distanceArg + 1 < args.size()) {
+        setRenderDistance(args[distanceArg + 1].toInt());
+    }
 }
 
 MyGL::~MyGL() {
+    m_simRunning = false;
+    if (m_simThread.joinable()) {
+        m_simThread.join();
+    }
     makeCurrent();
+    m_terrain.setUploader(nullptr);
+    m_uploader.reset();
+    m_terrain.setChunkRenderer(nullptr);
+    m_chunkRenderer.reset();
+    m_shadows.destroy();
     glDeleteVertexArrays(1, &vao);
+    glDeleteBuffers(1, &m_frameUBO);
 }
 
 
@@ -76,10 +109,20 @@ void MyGL::initializeGL()
     progShadows.create(":/glsl/shadows.vert.glsl", ":/glsl/shadows.frag.glsl");
 
     postProcessFBO.create();
-    shadowFBO.create(true);
+    m_shadows.create();
 
     m_progSky.create(":/glsl/sky.vert.glsl", ":/glsl/sky.frag.glsl");
 
+    // Camera, light and time, shared by all of the programs above
+    glGenBuffers(1, &m_frameUBO);
+    glBindBuffer(GL_UNIFORM_BUFFER, m_frameUBO);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameUniforms), nullptr, GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_UNIFORM_BUFFER, FRAME_UNIFORMS_BINDING, m_frameUBO);
+    // Nothing we draw is transformed
+    m_progLambert.setUnifMat4(ShaderProgram::U_MODEL, glm::mat4(1.f));
+    m_progLambert.setUnifMat4(ShaderProgram::U_MODEL_INV_TR, glm::mat4(1.f));
+    m_progFlat.setUnifMat4(ShaderProgram::U_MODEL, glm::mat4(1.f));
+
 if (!QFile(":/textures/minecraft_textures_all.png").exists()){
         std::cerr << "error: tex file not found" << std::endl;
     } else {
@@ -89,8 +132,9 @@ if (!QFile(":/textures/minecraft_textures_all.png").exists()){
     glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA); //transparency effect
 
 
-    int x = (m_player.mcr_position.x - 32) - ((int)(m_player.mcr_position.x - 32) % 64);
-    int z = (m_player.mcr_position.z - 32) - ((int)(m_player.mcr_position.z - 32) % 64);
+    glm::ivec2 zone = zoneAround(m_player.mcr_position.x, m_player.mcr_position.z);
+    int x = zone.x;
+    int z = zone.y;
 
     for(int i = -1; i <= 1; i++) {
         for(int j = -1; j <= 1; j++) {
@@ -105,7 +149,40 @@ if (!QFile(":/textures/minecraft_textures_all.png").exists()){
     // glBindBuffer(GL_ARRAY_BUFFER, 0);
     // glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 
-    m_player.move(glm::vec3(47.f, 164.f, 170.f));
+    // Stand the player on top of whatever was generated under the spawn point
+    glm::vec3 spawn = PLAYER_SPAWN;
+    int surface = m_terrain.getSurfaceHeight(spawn.x, spawn.z);
+    if (surface >= 0) {
+        spawn.y = surface + 1;
+    }
+    m_player.move(spawn);
+    m_prevPlayerPos = spawn;
+    snapshotSimulation();
+
+    // Chunks are drawn from shared buffers, a pass at a time, unless
+    // started with --per-chunk-draws
+    if (QCoreApplication::arguments().indexOf("--per-chunk-draws") < 0) {
+        m_chunkRenderer = mkU<ChunkRenderer>(this);
+        if (m_chunkRenderer->isValid()) {
+            m_terrain.setChunkRenderer(m_chunkRenderer.get());
+        } else {
+            m_chunkRenderer.reset();
+        }
+    }
+
+    // With --upload-thread, meshes go to the GPU through a second context
+    // on its own thread instead of in tick()
+    if (QCoreApplication::arguments().indexOf("--upload-thread") >= 0) {
+        m_uploader = mkU<GLUploader>(this);
+        if (m_uploader->isValid()) {
+            m_terrain.setUploader(m_uploader.get());
+        } else {
+            m_uploader.reset();
+        }
+    }
+
+    m_simRunning = true;
+    m_simThread = std::thread(&MyGL::simulationLoop, this);
 
     // We have to have a VAO bound in OpenGL 3.2 Core. But if we're not
     // using multiple VAOs, we can just bind one once.
@@ -116,82 +193,182 @@ if (!QFile(":/textures/minecraft_textures_all.png").exists()){
 void MyGL::resizeGL(int w, int h) {
     //This code sets the concatenated view and perspective projection matrices used for
     //our scene's camera view.
+    m_simMutex.lock();
     m_player.setCameraWidthHeight(static_cast<unsigned int>(w), static_cast<unsigned int>(h));
-    glm::mat4 viewproj = m_player.mcr_camera.getViewProj();
-
-    // Upload the view-projection matrix to our shaders (i.e. onto the graphics card)
-
-    m_progLambert.setUnifMat4("u_ViewProj", viewproj);
-    m_progFlat.setUnifMat4("u_ViewProj", viewproj);
-    m_progInstanced.setUnifMat4("u_ViewProj", viewproj);
+    m_simMutex.unlock();
+    snapshotSimulation();
 
     postProcessFBO.resize(w, h, this->devicePixelRatio());
     postProcessFBO.destroy();
     postProcessFBO.create();
 
-    shadowFBO.resize(4096/this->devicePixelRatio(), 4096/this->devicePixelRatio(), this->devicePixelRatio());
-    shadowFBO.destroy();
-    shadowFBO.create();
-    //position sky
-    glm::mat4 viewProjInv = glm::inverse(viewproj);
-    m_progSky.setUnifMat4("u_ViewProjInv", viewProjInv);
-    m_progSky.setUnifVec3("u_CameraPos", m_player.mcr_camera.mcr_position);
-
     printGLErrorLog();
 }
 
 
-// MyGL's constructor links tick() to a timer that fires 60 times per second.
-// We're treating MyGL as our game engine class, so we're going to perform
-// all per-frame actions here, such as performing physics updates on all
-// entities in the scene.
-void MyGL::tick() {
-    // Calculate dT
-    qint64 currentTime = QDateTime::currentMSecsSinceEpoch();
-    float dT = (currentTime - m_lastTime) / 1000.f;
-    if (dT > 0) {
-        m_lastTime = currentTime;
+// Runs on m_simThread. We're treating MyGL as our game engine class, so
+// this steps physics on all entities in the scene and schedules terrain
+// work, at a fixed rate independent of how fast we can draw.
+void MyGL::simulationLoop() {
+    const auto step = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<float>(SIM_STEP));
+    auto next = std::chrono::steady_clock::now();
+    while (m_simRunning) {
+        m_simMutex.lock();
+        stepSimulation();
+        m_simMutex.unlock();
+
+        // Behind schedule we step again straight away, which keeps the
+        // timestep fixed; after a long stall we give up on catching up
+        next += step;
+        auto now = std::chrono::steady_clock::now();
+        if (now - next > std::chrono::milliseconds(250)) {
+            next = now;
+        }
+        std::this_thread::sleep_until(next);
     }
+}
 
-    auto f = [this](float x, float z) {
-        m_terrain.GenerateTerrain(x, z);
-    };
+void MyGL::stepSimulation() {
+    m_prevPlayerPos = m_player.mcr_position;
+    m_player.tick(SIM_STEP, m_inputs); // Player-side tick
+    m_inputs.mouseX = 0;
+    m_inputs.mouseY = 0;
+    m_lastStepTime = std::chrono::steady_clock::now();
+
+    // Queued work is reordered around wherever the player is now facing
+    glm::vec3 look = m_player.mcr_camera.getLook();
+    m_jobs.setFocus(glm::vec2(m_player.mcr_position.x, m_player.mcr_position.z), glm::vec2(look.x, look.z));
+
+    glm::ivec2 zone = zoneAround(m_player.mcr_position.x, m_player.mcr_position.z);
+    int x = zone.x;
+    int z = zone.y;
+
+    // The player is up to 64 blocks from the centre of their zone, and a
+    // Chunk at the edge of what's drawn needs its neighbours to mesh, so
+    // zones are requested this many rings out. Work is only abandoned a
+    // ring further, and zones unloaded one further still, so hovering on
+    // a border doesn't thrash.
+    const int renderDistance = m_renderDistance;
+    const int rings = (renderDistance + 48 + 63) / 64;
+    const float interest = 64 * (rings + 1) + 32;
+    m_terrain.setInterest(glm::vec2(zone) + 32.f, interest);
+    m_terrain.unloadZonesOutside(glm::vec2(zone) + 32.f, interest + 64);
+
+    // Ring by ring, so when Terrain pushes back it's the furthest
+    // zones that wait for the next step
+    for(int ring = 0; ring <= rings; ring++) {
+        for(int i = -ring; i <= ring; i++) {
+            for(int j = -ring; j <= ring; j++) {
+                if (std::max(std::abs(i), std::abs(j)) != ring) {
+                    continue;
+                }
+                int zx = x + i * 64;
+                int zz = z + j * 64;
+                if(!m_terrain.hasTerrainAt(zx, zz) && m_terrain.requestZone(zx, zz)) {
+                     glm::vec2 center(zx + 32, zz + 32);
+                     m_jobs.push([this, zx, zz, center]() {
+                         m_terrain.GenerateTerrain(zx, zz, [this, center]() { return !m_terrain.isOfInterest(center); });
+                     }, center);
+                }
+            }
+        }
+    }
 
-    int x = (m_player.mcr_position.x - 32) - ((int)(m_player.mcr_position.x - 32) % 64);
-    int z = (m_player.mcr_position.z - 32) - ((int)(m_player.mcr_position.z - 32) % 64);
+    m_terrain.scheduleChunkStages();
+}
 
+void MyGL::snapshotSimulation() {
+    // Draw the player where they were a fraction of a step ago, between
+    // the last two simulation steps, so motion stays smooth whatever
+    // the frame rate
+    std::lock_guard<std::mutex> lock(m_simMutex);
+    float alpha = std::chrono::duration<float>(std::chrono::steady_clock::now() - m_lastStepTime).count() / SIM_STEP;
+    glm::vec3 pos = glm::mix(m_prevPlayerPos, m_player.mcr_position, glm::clamp(alpha, 0.f, 1.f));
 
-    std::vector<std::thread> blockTypeWorkers = {};
+    Camera camera(m_player.mcr_camera);
+    camera.moveAlongVector(pos - m_player.mcr_position);
+    m_renderViewProj = camera.getViewProj();
+    m_renderCameraPos = camera.mcr_position;
+    m_renderPlayerPos = pos;
 
-    for(int i = -2; i <= 2; i++) {
-        for(int j = -2; j <= 2; j++) {
-            // std::cout << x + i * 64 << ", " << z + j * 64 << std::endl;
-            if(!m_terrain.hasTerrainAt(x + i * 64, z + j * 64)) {
-                 std::cout << "gen thread for terrain " << x + i * 64 << ", " << z + j * 64 << std::endl;
-                 blockTypeWorkers.push_back(std::thread(f, x + i * 64, z + j * 64));
-                // f(x + i * 64, z + j * 64);
-            }
-            // std::cout << "COokie" << std::endl;
-        }
-    }
+    sendPlayerDataToGUI(); // Updates the info in the secondary window displaying player data
+}
 
+// MyGL's constructor links tick() to a timer that fires 60 times per second.
+// The simulation runs on its own thread; this is the render side, which
+// uploads finished Chunks and asks for a repaint.
+void MyGL::tick() {
+    qint64 currentTime = QDateTime::currentMSecsSinceEpoch();
 
-    m_terrain.loadChunkVBOs();
+    snapshotSimulation();
 
-    for(auto &x : blockTypeWorkers) {
-        x.detach();
+    // Uploads make VAOs, which unlike buffers belong to this context alone
+    makeCurrent();
+    m_terrain.loadChunkVBOs(glm::vec2(m_renderPlayerPos.x, m_renderPlayerPos.z));
+    if (m_terrain.uploadStats().released > 0) {
+        // Some of last frame's Chunks may be gone
+        m_visibleChunks.clear();
     }
+    m_frameUploads += m_terrain.uploadStats().uploads;
+    m_maxFrameUploads = std::max(m_maxFrameUploads, m_terrain.uploadStats().uploads);
 
+    if (m_teleportTime >= 0 && m_terrain.hasMeshAt(m_renderPlayerPos.x, m_renderPlayerPos.z)) {
+        std::cout << "time to visible after teleport: " << currentTime - m_teleportTime << " ms" << std::endl;
+        m_teleportTime = -1;
+    }
 
-    m_player.tick(dT, m_inputs); // Player-side tick
+    if (currentTime - m_lastStatsTime >= 1000) {
+        m_lastStatsTime = currentTime;
+        JobStats js = m_jobs.stats();
+        std::cout << "jobs: " << js.queued << " queued (peak " << js.peakQueued << "), " << js.completed << " done (" << js.stolen << " stolen, "
+                  << m_terrain.generationStats().cancelled << " cancelled), wait "
+                  << js.meanWaitMs << " ms avg / " << js.maxWaitMs << " ms max, run " << js.meanRunMs << " ms avg / "
+                  << js.maxRunMs << " ms max" << std::endl;
+        const ZoneStats &zs = m_terrain.zoneStats();
+        std::cout << "zones: " << zs.inFlight << " in flight (peak " << zs.peakInFlight << "), " << zs.requested << " requested, "
+                  << zs.duplicates << " duplicates avoided, " << zs.deferred << " deferred, " << zs.loaded << " loaded from disk" << std::endl;
+        const CullStats &cs = m_terrain.cullStats();
+        std::cout << "culling: " << cs.chunksDrawn << " chunks drawn by the camera, " << cs.chunksTested << " chunks and "
+                  << cs.groupsTested << " groups tested, " << cs.sectionsHidden << " sections hidden by caves, "
+                  << cs.facesSkipped << " of " << cs.opaqueFaces << " opaque faces facing away" << std::endl;
+        const UploadStats &us = m_terrain.uploadStats();
+        std::cout << "uploads: " << (m_frames > 0 ? float(m_frameUploads) / m_frames : 0.f) << " per frame avg, "
+                  << m_maxFrameUploads << " max, backlog " << us.backlog << ", " << us.inFlight << " on the upload thread, worst frame " << m_worstFrameMs << " ms" << std::endl;
+        if (m_chunkRenderer != nullptr) {
+            const ChunkRenderStats &rs = m_chunkRenderer->stats();
+            std::cout << "chunk draws: " << (m_frames > 0 ? float(rs.commands) / m_frames : 0.f) << " ranges in "
+                      << (m_frames > 0 ? float(rs.drawCalls) / m_frames : 0.f) << " calls per frame, buffers "
+                      << m_chunkRenderer->bytesUsed() / (1 << 20) << " of " << m_chunkRenderer->bytesAllocated() / (1 << 20)
+                      << " MB used" << std::endl;
+            m_chunkRenderer->resetStats();
+        }
+        std::cout << "shadows: " << (m_frames > 0 ? float(m_cascadesRendered) / m_frames : 0.f) << " of "
+                  << SHADOW_CASCADES << " cascades redrawn per frame, " << (m_cascadesRendered > 0 ? float(m_castersDrawn) / m_cascadesRendered : 0.f)
+                  << " chunks drawn into each" << std::endl;
+        size_t loaded = m_terrain.loadedChunks();
+        std::cout << "render distance " << m_renderDistance << ": " << loaded << " chunks loaded ("
+                  << loaded * sizeof(Chunk) / (1 << 20) << " MB of blocks), "
+                  << (m_chunkRenderer != nullptr ? m_chunkRenderer->bytesUsed() / (1 << 20) : 0) << " MB of meshes, frame "
+                  << (m_frames > 0 ? m_totalFrameMs / m_frames : 0.0) << " ms avg / " << m_worstFrameMs << " ms worst" << std::endl;
+        m_worstFrameMs = 0.0;
+        m_totalFrameMs = 0.0;
+        m_frames = 0;
+        m_cascadesRendered = 0;
+        m_castersDrawn = 0;
+        m_frameUploads = 0;
+        m_maxFrameUploads = 0;
+    }
 
-    m_inputs.mouseX = 0;
-    m_inputs.mouseY = 0;
-    m_progLambert.setUnifFloat("u_Time", m_time);
     update(); // Calls paintGL() as part of a larger QOpenGLWidget pipeline
-    //check terrain expansion
-    // m_terrain.expandTerrainIfNeeded(m_player.mcr_position);
-    sendPlayerDataToGUI(); // Updates the info in the secondary window displaying player data
+}
+
+void MyGL::setRenderDistance(int blocks) {
+    blocks = glm::clamp(blocks / RENDER_DISTANCE_STEP * RENDER_DISTANCE_STEP, MIN_RENDER_DISTANCE, MAX_RENDER_DISTANCE);
+    if (blocks != m_renderDistance) {
+        // Picked up by the next step and the next frame
+        m_renderDistance = blocks;
+        std::cout << "render distance: " << blocks << " blocks" << std::endl;
+    }
 }
 
 void MyGL::sendPlayerDataToGUI() const {
@@ -210,33 +387,53 @@ void MyGL::sendPlayerDataToGUI() const {
 // MyGL's constructor links update() to a timer that fires 60 times per second,
 // so paintGL() called at a rate of 60 frames per second.
 void MyGL::paintGL() {
-    //bind to shadow mapping setup
-    glm::vec3 lightInvDir = glm::vec3(150, 100, 0);
-    shadowFBO.bindFrameBuffer();
-    glViewport(0, 0, 4096, 4096);
-    glClearColor(1.f, 1.f, 1.f, 1.f);
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    glEnable(GL_DEPTH_TEST);
+    if (m_frameTimer.isValid()) {
+        double frameMs = m_frameTimer.nsecsElapsed() / 1e6;
+        m_worstFrameMs = std::max(m_worstFrameMs, frameMs);
+        m_totalFrameMs += frameMs;
+        m_frames++;
+    }
+    m_frameTimer.start();
 
-    glm::mat4 depthProjectionMatrix = glm::ortho<float>(-100,100,-100,100, 2, 300);
-    glm::mat4 depthViewMatrix = glm::lookAt(lightInvDir + glm::vec3(m_player.mcr_position.x, 150, m_player.mcr_position.z), glm::vec3(m_player.mcr_position.x, 150, m_player.mcr_position.z), glm::normalize(glm::cross(lightInvDir, glm::vec3(0, 0, -1))));
-    glm::mat4 depthModelMatrix = glm::mat4(1.0);
-    glm::mat4 depthMVP = depthProjectionMatrix * depthViewMatrix * depthModelMatrix;
+    // Only the shadow cascades something has changed in are redrawn
+    glm::vec3 lightInvDir = glm::vec3(150, 100, 0);
+    if (m_shadowRenderDistance != m_renderDistance) {
+        m_shadowRenderDistance = m_renderDistance;
+        m_shadows.setRenderDistance(m_shadowRenderDistance);
+    }
+    m_terrain.takeMeshChanges(m_meshChanges);
+    unsigned staleCascades = m_shadows.update(m_renderPlayerPos, lightInvDir, m_meshChanges);
+
+    // One lookup of the Chunks around us for every pass below
+    findVisibleTerrain(staleCascades);
+
+    // Everything the scene shaders need to know about this frame, in one upload
+    FrameUniforms frame;
+    frame.viewProj = m_renderViewProj;
+    frame.viewProjInv = glm::inverse(m_renderViewProj);
+    for (int i = 0; i < SHADOW_CASCADES; i++) {
+        frame.shadowMVP[i] = m_shadows.textureMatrix(i);
+    }
+    frame.cameraPos = glm::vec4(m_renderCameraPos, 1.f);
+    frame.lightDir = glm::vec4(glm::normalize(lightInvDir), 0.f);
+    frame.time = m_time++;
+    glBindBuffer(GL_UNIFORM_BUFFER, m_frameUBO);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameUniforms), &frame);
 
-    progShadows.setUnifMat4("u_DepthMVP", depthMVP);
+    glEnable(GL_DEPTH_TEST);
     // glEnable(GL_CULL_FACE);
     glCullFace(GL_FRONT);
-    renderTerrain(progShadows, true, false);
+    for (int i = 0; i < SHADOW_CASCADES; i++) {
+        if (staleCascades & (1u << i)) {
+            m_shadows.bindCascade(i);
+            progShadows.setUnifMat4(ShaderProgram::U_LIGHT_VIEW_PROJ, m_shadows.viewProj(i));
+            renderTerrain(progShadows, shadowPass(i), true, false);
+            m_cascadesRendered++;
+            m_castersDrawn += m_terrain.cullStats().castersFound[i];
+        }
+    }
     glDisable(GL_CULL_FACE);
 
-    glm::mat4 biasMatrix(
-        0.5, 0.0, 0.0, 0.0,
-        0.0, 0.5, 0.0, 0.0,
-        0.0, 0.0, 0.5, 0.0,
-        0.5, 0.5, 0.5, 1.0
-        );
-    glm::mat4 depthBiasMVP = biasMatrix*depthMVP;
-
     // redirect to postprocess
     postProcessFBO.bindFrameBuffer();
     glViewport(0, 0, width() * this->devicePixelRatio(), height() * this->devicePixelRatio());
@@ -245,43 +442,23 @@ void MyGL::paintGL() {
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
     glEnable(GL_DEPTH_TEST);
 
-    shadowFBO.bindToTextureSlot(1);
-    m_progLambert.setUnifMat4("u_DepthBiasMVP", depthBiasMVP);
+    m_shadows.bindToTextureSlot(1);
     m_texture.bind(0);
-    m_progLambert.useMe();
-    this->glUniform1i(m_progLambert.m_unifs["u_ShadowMap"], shadowFBO.getTextureSlot());
-
-    glm::mat4 viewproj = m_player.mcr_camera.getViewProj();
+    m_progLambert.setUnifInt(ShaderProgram::U_SHADOW_MAP, 1);
 
     glDisable(GL_CULL_FACE);
     // glDisable(GL_DEPTH_TEST);
 
-    m_progSky.useMe();
-    glm::mat4 viewProjInv = glm::inverse(viewproj);
-    m_progSky.setUnifMat4("u_ViewProjInv", viewProjInv);
-    m_progSky.setUnifVec3("u_CameraPos", m_player.mcr_camera.mcr_position);
     m_progSky.drawSky(m_quad);
-    m_progSky.setUnifFloat("u_Time", m_time);
 
     // glEnable(GL_CULL_FACE);
     glEnable(GL_DEPTH_TEST);
-  
-    m_progLambert.setUnifMat4("u_ViewProj", viewproj);
-    m_progLambert.setUnifMat4("u_Model", glm::mat4());
-    m_progLambert.setUnifMat4("u_ModelInvTr", glm::mat4());
-    m_progLambert.setUnifVec3("u_CameraPos", m_player.mcr_camera.mcr_position);
-    m_progLambert.setUnifVec3("lightDir", glm::normalize(lightInvDir));
-    m_progFlat.setUnifMat4("u_ViewProj", viewproj);
-    m_progInstanced.setUnifMat4("u_ViewProj", viewproj);
-
-    m_progLambert.setUnifFloat("u_Time", m_time++);
 
-    progPostProcess.setUnifFloat("u_Time", (QDateTime::currentMSecsSinceEpoch() - m_startTime) / 1000.f);
+    progPostProcess.setUnifFloat(ShaderProgram::U_TIME, (QDateTime::currentMSecsSinceEpoch() - m_startTime) / 1000.f);
 
-    renderTerrain(m_progLambert);
+    renderTerrain(m_progLambert, PASS_CAMERA);
 
     glDisable(GL_DEPTH_TEST);
-    m_progFlat.setUnifMat4("u_Model", glm::mat4());
     // m_progFlat.drawOpq(m_worldAxes);
     glEnable(GL_DEPTH_TEST);
 
@@ -301,21 +478,18 @@ void MyGL::paintGL() {
     // Set the sampler2D in the post-process shader to
     // read from the texture slot that we set the
     // texture into
-    progPostProcess.useMe();
-
-    this->glUniform1i(progPostProcess.m_unifs["u_Texture"],
-                       postProcessFBO.getTextureSlot());
-    progPostProcess.setUnifVec2("u_Resolution", glm::vec2(this->width() * this->devicePixelRatio(), this->height() * this->devicePixelRatio()));
+    progPostProcess.setUnifInt(ShaderProgram::U_TEXTURE, postProcessFBO.getTextureSlot());
+    progPostProcess.setUnifVec2(ShaderProgram::U_RESOLUTION, glm::vec2(this->width() * this->devicePixelRatio(), this->height() * this->devicePixelRatio()));
 
     // Check camera position to determine post process effect
-    if (m_terrain.hasChunkAt(m_player.mcr_position.x, m_player.mcr_position.z)) {
-        BlockType block = m_terrain.getGlobalBlockAt(m_player.mcr_position.x, m_player.mcr_position.y+1.5f, m_player.mcr_position.z);
+    BlockType block;
+    if (m_terrain.findGlobalBlockAt(m_renderPlayerPos.x, m_renderPlayerPos.y+1.5f, m_renderPlayerPos.z, block)) {
         if (block == WATER) {
-            this->glUniform1i(progPostProcess.m_unifs["u_PostEffect"], 1);
+            progPostProcess.setUnifInt(ShaderProgram::U_POST_EFFECT, 1);
         } else if (block == LAVA) {
-            this->glUniform1i(progPostProcess.m_unifs["u_PostEffect"], 2);
+            progPostProcess.setUnifInt(ShaderProgram::U_POST_EFFECT, 2);
         } else {
-            this->glUniform1i(progPostProcess.m_unifs["u_PostEffect"], 0);
+            progPostProcess.setUnifInt(ShaderProgram::U_POST_EFFECT, 0);
         }
     }
 
@@ -323,24 +497,24 @@ void MyGL::paintGL() {
     progPostProcess.drawOpq(quadDrawable);
 }
 
-// TODO: Change this so it renders the nine zones of generated
-// terrain that surround the player (refer to Terrain::m_generatedTerrain
-// for more info)
-void MyGL::renderTerrain(ShaderProgram &prog, bool opq, bool trans) {
-    int x = m_player.mcr_position.x;
-    int z = m_player.mcr_position.z;
-
-    // for(int i = -1; i <= 1; i++) {
-    //     for(int j = -1; j <= 1; j++) {
-    //         int xCoord = x - 32 + i * 64;
-    //         int zCoord = z - 32 + j * 64;
-
-    //         // m_terrain.GenerateTerrain(xCoord, zCoord);
-    //     }
-    // }
-
-    m_terrain.draw( x - 64, x + 64, z-64, z+64, &prog, opq, trans);
+void MyGL::findVisibleTerrain(unsigned staleCascades) {
+    int x = m_renderPlayerPos.x;
+    int z = m_renderPlayerPos.z;
+    const int renderDistance = m_renderDistance;
+    CullView view{Frustum(m_renderViewProj), m_renderCameraPos, true, {}};
+    for (int i = 0; i < SHADOW_CASCADES; i++) {
+        if (staleCascades & (1u << i)) {
+            // Only what shadows the blocks the camera pass can draw
+            view.shadows.push_back({i, m_shadows.casterViewProj(i, renderDistance)});
+        }
+    }
+    m_terrain.findVisible(x - renderDistance, x + renderDistance, z - renderDistance, z + renderDistance, &view, m_visibleChunks);
+}
 
+void MyGL::renderTerrain(ShaderProgram &prog, RenderPass pass, bool opq, bool trans) {
+    m_terrain.draw(m_visibleChunks, &prog, pass, opq, trans);
+    // Chunks draw with VAOs of their own; everything else shares vao
+    glBindVertexArray(vao);
 }
 
 
@@ -349,6 +523,7 @@ void MyGL::keyPressEvent(QKeyEvent *e) {
     if(e->modifiers() & Qt::ShiftModifier){
         amount = 10.0f;
     }
+    std::lock_guard<std::mutex> lock(m_simMutex);
     switch (e->key()) {
         case Qt::Key_Escape:
             QApplication::quit();
@@ -386,6 +561,23 @@ void MyGL::keyPressEvent(QKeyEvent *e) {
         case Qt::Key_Space:
             m_inputs.spacePressed = true;
             break;
+        case Qt::Key_T:
+        {
+            // Jump 512 blocks ahead into terrain that doesn't exist yet, and
+            // time how long until the Chunk underfoot is on screen
+            glm::vec3 look = m_player.mcr_camera.getLook();
+            glm::vec2 dir = glm::length(glm::vec2(look.x, look.z)) > 1e-4f ? glm::normalize(glm::vec2(look.x, look.z)) : glm::vec2(0, -1);
+            m_player.moveAlongVector(512.f * glm::vec3(dir.x, 0, dir.y));
+            m_prevPlayerPos = m_player.mcr_position; // Don't interpolate across the jump
+            m_teleportTime = QDateTime::currentMSecsSinceEpoch();
+            break;
+        }
+        case Qt::Key_Minus:
+            setRenderDistance(m_renderDistance - RENDER_DISTANCE_STEP);
+            break;
+        case Qt::Key_Equal:
+            setRenderDistance(m_renderDistance + RENDER_DISTANCE_STEP);
+            break;
         case Qt::Key_F:
             switch (m_player.m_movementMode) {
                 case MovementMode::WALKING:
@@ -401,6 +593,7 @@ void MyGL::keyPressEvent(QKeyEvent *e) {
 }
 
 void MyGL::keyReleaseEvent(QKeyEvent *e) {
+    std::lock_guard<std::mutex> lock(m_simMutex);
     switch (e->key()) {
         case Qt::Key_W:
             m_inputs.wPressed = false;
@@ -432,12 +625,17 @@ void MyGL::mouseMoveEvent(QMouseEvent *e) {
     // update m_inputs.mouseX and m_inputs.mouseY
     // based on the change in the mouse's position
     // since the last change.
+    m_simMutex.lock();
     m_inputs.mouseX += width() / 2 - e->position().x();
     m_inputs.mouseY += height() / 2 - e->position().y();
+    m_simMutex.unlock();
     moveMouseToCenter();
 }
 
 void MyGL::mousePressEvent(QMouseEvent *e) {
+    // The player mustn't move while we march the ray, nor the
+    // simulation schedule a remesh of a Chunk mid-edit
+    std::lock_guard<std::mutex> lock(m_simMutex);
     // generate ray
     glm::vec3 ray = m_player.mcr_camera.getLook();
     glm::vec3 currPos = m_player.mcr_camera.mcr_position;
@@ -460,41 +658,18 @@ void MyGL::mousePressEvent(QMouseEvent *e) {
             currPos.z = nextZ;
             currPos.z += ray.z >= 0 ? 0.01f : -0.01f;
         }
-        if (m_terrain.hasChunkAt(currPos.x, currPos.z)){
-            BlockType block = m_terrain.getGlobalBlockAt(currPos.x, currPos.y, currPos.z);
+        BlockType block;
+        if (m_terrain.findGlobalBlockAt(currPos.x, currPos.y, currPos.z, block)){
             if (block == EMPTY || block == WATER || block == LAVA) {
                 continue;
             }
             switch (e->button()) {
                 case Qt::LeftButton:
                 std::cout << "remove block" << std::endl;
-                    if (m_terrain.getGlobalBlockAt(currPos.x, currPos.y, currPos.z) != BEDROCK) {
+                    if (block != BEDROCK) {
+                        // The scheduler remeshes this Chunk, and any neighbour
+                        // sharing the removed block's faces
                         m_terrain.setGlobalBlockAt(currPos.x, currPos.y, currPos.z, EMPTY);
-
-                        auto myChunk = m_terrain.getChunkAt(currPos.x, currPos.z).get();
-
-                        for(int i = -1; i <= 1; i++) {
-                            for(int j = -1; j <= 1; j++) {
-                                if ((i != 0 && j != 0) || (i == 0 && j == 0)) {
-                                    continue;
-                                }
-
-                                if (myChunk != m_terrain.getChunkAt(currPos.x + i, currPos.z + j).get()) {
-                                    auto chunk = m_terrain.getChunkAt(currPos.x + i, currPos.z + j).get();
-                                    chunk->createVBOdata();
-                                    chunk->loadToGPU();
-                                }
-                            }
-                        }
-
-                        myChunk->createVBOdata();
-                        myChunk->loadToGPU();
-                        // m_terrain.getChunkAt(currPos.x, currPos.z)->loaded = false;                        m_terrain.getChunkAt(currPos.x, currPos.z)->createVBOdata();
-                        // m_terrain.getChunkAt(currPos.x, currPos.z)->ready = true;
-                        // m_terrain.getChunkAt(currPos.x, currPos.z)->loaded = false;
-                        // m_terrain.getChunkAt(currPos.x, currPos.z)->ready = true;
-                        // m_terrain.loadChunkVBOs();
-                        // m_terrain.loadChunkVBOs();
                     }
                     break;
                 case Qt::RightButton:
@@ -509,9 +684,9 @@ void MyGL::mousePressEvent(QMouseEvent *e) {
                     if (zDist == minDist) {
                         shift.z += ray.z >= 0 ? -1 : 1;
                     }
-                    if (m_terrain.hasChunkAt(currPos.x + shift.x, currPos.z + shift.z) && m_terrain.getGlobalBlockAt(currPos.x + shift.x, currPos.y + shift.y, currPos.z + shift.z) == EMPTY) {
+                    BlockType target;
+                    if (m_terrain.findGlobalBlockAt(currPos.x + shift.x, currPos.y + shift.y, currPos.z + shift.z, target) && target == EMPTY) {
                         m_terrain.setGlobalBlockAt(currPos.x + shift.x, currPos.y + shift.y, currPos.z + shift.z, GRASS);
-                        m_terrain.getChunkAt(currPos.x + shift.x, currPos.z + shift.z)->createVBOdata();
                     }
                     break;
                 }
@@ -11,10 +11,19 @@
 #include "texture.h"
 #include "scene/skyQuad.h"
 #include "scene/quad.h"
+#include "jobsystem.h"
+#include "gluploader.h"
+#include "chunkrenderer.h"
+#include "shadowcascades.h"
 
 #include <QOpenGLVertexArrayObject>
 #include <QOpenGLShaderProgram>
+#include <QElapsedTimer>
 #include <smartpointerhelp.h>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
 
 
 class MyGL : public OpenGLContext
@@ -29,11 +38,16 @@ private:
 
     GLuint vao; // A handle for our vertex array object. This will store the VBOs created in our geometry classes.
                 // Don't worry too much about this. Just know it is necessary in order to render geometry.
+    GLuint m_frameUBO; // FrameData for every scene shader, refilled at the start of each frame
 
     Texture m_texture;
 
+    uPtr<WorldStore> m_worldStore; // Pregenerated zones, when started with --world <dir>. Declared before m_terrain, which points at it.
     Terrain m_terrain; // All of the Chunks that currently comprise the world.
     Player m_player; // The entity controlled by the user. Contains a camera to display what it sees as well.
+    JobSystem m_jobs; // Workers for terrain generation and meshing. Declared after m_terrain so it drains first on shutdown.
+    uPtr<GLUploader> m_uploader; // Set if started with --upload-thread
+    uPtr<ChunkRenderer> m_chunkRenderer; // Unset if started with --per-chunk-draws, or if the context can't multi-draw
 
     SkyQuad m_quad;
 
@@ -49,16 +63,59 @@ private:
 
     void sendPlayerDataToGUI() const;
 
+    void simulationLoop(); // Body of m_simThread
+    void stepSimulation(); // Advances the simulation by SIM_STEP. Caller holds m_simMutex.
+    void snapshotSimulation(); // Interpolates the player between the last two steps into m_render*
+    void setRenderDistance(int blocks); // Rounded to RENDER_DISTANCE_STEP and clamped
+
     qint64 m_startTime; // Time when the game is booted
 
-    qint64 m_lastTime; // Used to calculate dT in tick().
+    qint64 m_lastStatsTime; // When the job queue stats were last logged
+    qint64 m_teleportTime; // When the player last teleported (T), or -1 once the destination is visible
+
+    // The simulation (player physics and terrain scheduling) steps at a
+    // fixed rate on its own thread; m_simMutex guards m_player and
+    // m_inputs. Take it before Terrain's chunkMutex, never after.
+    static constexpr float SIM_STEP = 1.f / 60.f;
+    std::thread m_simThread;
+    std::atomic<bool> m_simRunning;
+    std::mutex m_simMutex;
+    glm::vec3 m_prevPlayerPos; // Player position before the latest step, to interpolate from
+    std::chrono::steady_clock::time_point m_lastStepTime;
+
+    // Blocks from the player to the edge of what's drawn along x and z.
+    // Everything else follows from it: the zones generated, the area
+    // meshed, how far shadows reach and when zones are unloaded again.
+    // Set with --render-distance <blocks>, and - and = while playing.
+    static constexpr int MIN_RENDER_DISTANCE = 32;
+    static constexpr int MAX_RENDER_DISTANCE = 512;
+    static constexpr int RENDER_DISTANCE_STEP = 16;
+    std::atomic<int> m_renderDistance;
+    int m_shadowRenderDistance; // What m_shadows was last sized for
+
+    // What the GUI thread draws this frame, copied from the simulation in tick()
+    glm::mat4 m_renderViewProj;
+    glm::vec3 m_renderCameraPos;
+    glm::vec3 m_renderPlayerPos;
+    VisibleSet m_visibleChunks; // Refound at the start of each paintGL()
+
+    // Streaming stats, logged with the job stats once a second
+    QElapsedTimer m_frameTimer; // Time since the last paintGL()
+    double m_worstFrameMs;
+    double m_totalFrameMs;
+    int m_frames;
+    int m_frameUploads;
+    int m_maxFrameUploads;
+    int m_cascadesRendered; // Shadow cascades that went stale and were redrawn
+    int m_castersDrawn;     // Chunks drawn into them
 
     ShaderProgram progPostProcess; // shader for application of post-process
     FrameBuffer postProcessFBO; // framebuffer for post-process
     Quad quadDrawable;
 
     ShaderProgram progShadows; // shader for shadow mapping
-    FrameBuffer shadowFBO; // framebuffer for shadow mapping
+    ShadowCascades m_shadows; // shadow maps, redrawn only once they go stale
+    std::vector<glm::ivec2> m_meshChanges; // Chunks remeshed since the last frame, for m_shadows
 
 
 public:
@@ -77,8 +134,11 @@ public:
     void paintGL() override;
 
     // Called from paintGL().
-    // Calls Terrain::draw().
-    void renderTerrain(ShaderProgram &shader, bool opq = true, bool trans = true);
+    // Finds the Chunks this frame's passes draw: those the camera can see,
+    // and those that can cast into the shadow cascades in staleCascades
+    void findVisibleTerrain(unsigned staleCascades);
+    // Calls Terrain::draw() with the Chunks findVisibleTerrain() found
+    void renderTerrain(ShaderProgram &shader, RenderPass pass, bool opq = true, bool trans = true);
 
 protected:
     // Automatically invoked when the user
@@ -0,0 +1,122 @@
+#include "pregenerate.h"
+#include "jobsystem.h"
+#include "scene/terrain.h"
+#include "scene/player.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+static int findArg(int argc, char *argv[], const char *name) {
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static const char* stringArg(int argc, char *argv[], const char *name, const char *fallback) {
+    int i = findArg(argc, argv, name);
+    return (i >= 0 && i + 1 < argc) ? argv[i + 1] : fallback;
+}
+
+bool isPregenerateRun(int argc, char *argv[]) {
+    return findArg(argc, argv, "--pregenerate") >= 0;
+}
+
+int runPregeneration(int argc, char *argv[]) {
+    const int radius = std::max(0, std::atoi(stringArg(argc, argv, "--pregenerate", "4")));
+    const std::string directory = stringArg(argc, argv, "--world", "world");
+    const bool mesh = findArg(argc, argv, "--mesh") >= 0;
+    const int hardwareThreads = std::max(1u, std::thread::hardware_concurrency());
+    const int threads = std::max(1, std::atoi(stringArg(argc, argv, "--threads", std::to_string(hardwareThreads).c_str())));
+
+    WorldStore store(directory);
+    Terrain terrain(nullptr);
+    terrain.setWorldStore(&store);
+    terrain.setMeshingEnabled(mesh);
+
+    const glm::ivec2 center = zoneAround(PLAYER_SPAWN.x, PLAYER_SPAWN.z);
+    const int side = 2 * radius + 1;
+    std::cout << "Pregenerating " << side << " x " << side << " zones around (" << center.x << ", " << center.y
+              << ") into " << directory << " on " << threads << " threads" << (mesh ? ", with meshes" : "") << std::endl;
+
+    // Chunks along the edge of the saved area need their outer neighbours
+    // carved and decorated too, so one extra ring of zones is generated but
+    // not saved.
+    auto zoneDone = [&terrain, mesh](int zx, int zz) {
+        for (int x = zx; x < zx + 64; x += 16) {
+            for (int z = zz; z < zz + 64; z += 16) {
+                if (!terrain.isChunkFinal(x, z) || (mesh && terrain.chunkState(x, z) != ChunkState::MESHED)) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    {
+        JobSystem jobs(threads);
+        terrain.setJobLauncher([&jobs](glm::vec2 where, std::function<void()> job) { jobs.push(std::move(job), where); });
+
+        // Finish the middle first, so an interrupted run still leaves
+        // the zones nearest spawn complete
+        jobs.setFocus(glm::vec2(center) + 32.f, glm::vec2(0.f));
+
+        for (int i = -radius - 1; i <= radius + 1; i++) {
+            for (int j = -radius - 1; j <= radius + 1; j++) {
+                int zx = center.x + 64 * i;
+                int zz = center.y + 64 * j;
+                jobs.push([&terrain, zx, zz]() { terrain.GenerateTerrain(zx, zz); }, glm::vec2(zx + 32, zz + 32));
+            }
+        }
+
+        int reported = -1;
+        while (true) {
+            terrain.scheduleChunkStages();
+
+            int done = 0;
+            for (int i = -radius; i <= radius; i++) {
+                for (int j = -radius; j <= radius; j++) {
+                    done += zoneDone(center.x + 64 * i, center.y + 64 * j) ? 1 : 0;
+                }
+            }
+            if (done != reported) {
+                reported = done;
+                std::cout << "  " << done << " / " << side * side << " zones ready" << std::endl;
+            }
+            if (done == side * side) {
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        }
+        terrain.setJobLauncher([](glm::vec2, std::function<void()> job) { job(); });
+    }
+
+    int written = 0;
+    for (int i = -radius; i <= radius; i++) {
+        for (int j = -radius; j <= radius; j++) {
+            int zx = center.x + 64 * i;
+            int zz = center.y + 64 * j;
+            std::vector<Chunk*> zone;
+            for (int x = zx; x < zx + 64; x += 16) {
+                for (int z = zz; z < zz + 64; z += 16) {
+                    zone.push_back(terrain.getChunkAt(x, z).get());
+                }
+            }
+            if (!store.saveZone(zx, zz, zone, mesh)) {
+                std::cerr << "error: could not write zone " << zx << ", " << zz << " to " << directory << std::endl;
+                return 1;
+            }
+            written++;
+        }
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Wrote " << written << " zones in " << seconds << " s" << std::endl;
+    return 0;
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+// Command-line world pregeneration. Runs without opening a window:
+//
+//   MiniMinecraft --pregenerate <radius> [--world <dir>] [--mesh] [--threads <n>]
+//
+// Generates every terrain zone within <radius> zones of the spawn zone on
+// all cores and writes them to the world store in <dir> (default "world").
+// With --mesh the Chunks are meshed as well and their face lists stored, so
+// a later "MiniMinecraft --world <dir>" skips generation and the first mesh
+// scan for everything inside the radius.
+bool isPregenerateRun(int argc, char *argv[]);
+int runPregeneration(int argc, char *argv[]);
@@ -1,12 +1,15 @@
 #include "chunk.h"
+#include <algorithm>
 #include <iostream>
 
 Chunk::Chunk(int x, int z, OpenGLContext* context) : Drawable(context), m_blocks(), minX(x), minZ(z), m_neighbors{{XPOS, nullptr}, {XNEG, nullptr}, {ZPOS, nullptr}, {ZNEG, nullptr}},
-blockMutex(), ready(false),
-    loaded(false),
-    working(false)
+blockMutex(), m_columnTops(), m_minY(256), m_maxY(-1), m_faces(), m_facesCached(false), m_sections(), m_drawnSections(),
+    m_meshMin(0.f), m_meshMax(-1.f), m_drawnMin(0.f), m_drawnMax(-1.f),
+    m_state(ChunkState::ALLOCATED), m_onGPU(false), m_opqVAO(0), m_transVAO(0),
+    stage(GenStage::NONE), staging(false), pins(0), edited(false)
 {
     std::fill_n(m_blocks.begin(), 65536, EMPTY);
+    m_columnTops.fill(-1);
 }
 
 // Does bounds checking with at()
@@ -26,9 +29,171 @@ BlockType Chunk::getLocalBlockAt(int x, int y, int z) {
 void Chunk::setLocalBlockAt(unsigned int x, unsigned int y, unsigned int z, BlockType t) {
     blockMutex.lock();
     m_blocks.at(x + 16 * y + 16 * 256 * z) = t;
+    updateHeights(x, y, z, t);
     blockMutex.unlock();
 }
 
+void Chunk::updateHeights(int x, int y, int z, BlockType t) {
+    int &top = m_columnTops[x + 16 * z];
+    if (t != EMPTY) {
+        top = std::max(top, y);
+        m_minY = std::min(m_minY, y);
+        m_maxY = std::max(m_maxY, y);
+        return;
+    }
+    if (y != top) {
+        return;
+    }
+    // The column's top block was removed; walk down to the next one
+    while (top >= 0 && m_blocks[x + 16 * top + 16 * 256 * z] == EMPTY) {
+        top--;
+    }
+    if (y == m_maxY) {
+        m_maxY = *std::max_element(m_columnTops.begin(), m_columnTops.end());
+    }
+}
+
+void Chunk::recomputeHeights() {
+    m_minY = 256;
+    m_maxY = -1;
+    for (int x = 0; x < 16; x++) {
+        for (int z = 0; z < 16; z++) {
+            int &top = m_columnTops[x + 16 * z];
+            top = -1;
+            for (int y = 0; y < 256; y++) {
+                if (m_blocks[x + 16 * y + 16 * 256 * z] != EMPTY) {
+                    m_minY = std::min(m_minY, y);
+                    top = y;
+                }
+            }
+            m_maxY = std::max(m_maxY, top);
+        }
+    }
+}
+
+int Chunk::getColumnTop(int x, int z) {
+    blockMutex.lock();
+    int top = m_columnTops.at(x + 16 * z);
+    blockMutex.unlock();
+    return top;
+}
+
+int Chunk::getMinY() {
+    blockMutex.lock();
+    int y = m_minY;
+    blockMutex.unlock();
+    return y;
+}
+
+int Chunk::getMaxY() {
+    blockMutex.lock();
+    int y = m_maxY;
+    blockMutex.unlock();
+    return y;
+}
+
+bool Chunk::getBounds(glm::vec3 &min, glm::vec3 &max) {
+    blockMutex.lock();
+    int minY = m_minY;
+    int maxY = m_maxY;
+    blockMutex.unlock();
+    if (maxY < 0) {
+        return false;
+    }
+    min = glm::vec3(minX, minY, minZ);
+    max = glm::vec3(minX + 16, maxY + 1, minZ + 16);
+    return true;
+}
+
+static int decorationRank(BlockType t) {
+    switch (t) {
+    case EMPTY: return 0;
+    case LEAVES: return 1;
+    case CACTUS: return 2;
+    case WOOD: return 3;
+    default: return -1;
+    }
+}
+
+void Chunk::placeDecorationAt(unsigned int x, unsigned int y, unsigned int z, BlockType t) {
+    blockMutex.lock();
+    BlockType &current = m_blocks.at(x + 16 * y + 16 * 256 * z);
+    int rank = decorationRank(current);
+    if (rank >= 0 && decorationRank(t) > rank) {
+        current = t;
+        updateHeights(x, y, z, t);
+    }
+    blockMutex.unlock();
+}
+
+static bool legalTransition(ChunkState from, ChunkState to) {
+    switch (to) {
+    case ChunkState::GENERATING: return from == ChunkState::ALLOCATED;
+    case ChunkState::GENERATED: return from == ChunkState::GENERATING;
+    case ChunkState::MESHING: return from == ChunkState::GENERATED || from == ChunkState::DIRTY;
+    case ChunkState::MESHED: return from == ChunkState::MESHING;
+    case ChunkState::UPLOADED: return from == ChunkState::MESHED;
+    case ChunkState::DIRTY: return from == ChunkState::MESHING || from == ChunkState::MESHED || from == ChunkState::UPLOADED;
+    default: return false;
+    }
+}
+
+ChunkState Chunk::getState() const {
+    return m_state;
+}
+
+bool Chunk::transition(ChunkState from, ChunkState to) {
+    if (!legalTransition(from, to)) {
+        std::cerr << "error: illegal Chunk state change " << static_cast<int>(from) << " -> " << static_cast<int>(to) << std::endl;
+        return false;
+    }
+    return m_state.compare_exchange_strong(from, to);
+}
+
+void Chunk::markDirty() {
+    ChunkState s = m_state;
+    while (legalTransition(s, ChunkState::DIRTY)) {
+        if (m_state.compare_exchange_weak(s, ChunkState::DIRTY)) {
+            return;
+        }
+    }
+}
+
+bool Chunk::hasGPUData() const {
+    return m_onGPU;
+}
+
+const SectionInfo& Chunk::drawnSection(int section) const {
+    return m_drawnSections[section];
+}
+
+uint8_t Chunk::facingDirections(glm::vec3 eye) const {
+    if (m_drawnMin.y > m_drawnMax.y) {
+        return 0;
+    }
+    // Each axis' positive Direction is followed by its negative one
+    static constexpr Direction positive[3] = {XPOS, YPOS, ZPOS};
+    uint8_t directions = 0;
+    for (int axis = 0; axis < 3; axis++) {
+        if (eye[axis] > m_drawnMin[axis]) {
+            directions |= 1 << positive[axis];
+        }
+        if (eye[axis] < m_drawnMax[axis]) {
+            directions |= 1 << (positive[axis] + 1);
+        }
+    }
+    return directions;
+}
+
+size_t Chunk::meshBytes() const {
+    return (opq_interleavedData.size() + trans_interleavedData.size()) * sizeof(glm::vec4)
+           + (opq_indices.size() + trans_indices.size()) * sizeof(GLuint);
+}
+
+glm::ivec2 Chunk::getCorner() const {
+    return glm::ivec2(minX, minZ);
+}
+
 std::unordered_map<BlockType, glm::vec2> Chunk::blockUVs = {
     {GRASS, glm::vec2(2, 15)},
     {DIRT, glm::vec2(2, 15)},
@@ -155,9 +320,29 @@ void Chunk::linkNeighbor(uPtr<Chunk> &neighbor, Direction dir) {
     }
 }
 
+void Chunk::unlinkNeighbors() {
+    // Every direction already has an entry, so this never rehashes a map
+    // another thread might be reading
+    for (auto &neighbor : m_neighbors) {
+        if (neighbor.second != nullptr) {
+            neighbor.second->m_neighbors[oppositeDirection.at(neighbor.first)] = nullptr;
+            neighbor.second = nullptr;
+        }
+    }
+}
+
 
 glm::vec2 Chunk::getUV(BlockType t, Direction dir) {
-    glm::vec2 baseUV = blockUVMap[t][dir];
+    // Read with find(): several workers mesh at once, and operator[]
+    // would insert into the shared map for blocks without UVs
+    glm::vec2 baseUV(0.f);
+    auto block = blockUVMap.find(t);
+    if (block != blockUVMap.end()) {
+        auto face = block->second.find(dir);
+        if (face != block->second.end()) {
+            baseUV = face->second;
+        }
+    }
     float offset = 0.0625f;
     return baseUV * offset;
 }
@@ -245,148 +430,319 @@ bool isTransparent(BlockType t) {
     return t == WATER || t == CACTUS || t == ICE;
 }
 
-void Chunk::generateVBOData() {
-    std::cout << "Generating Data" << std::endl;
-
-    opq_interleavedData.clear();
-    trans_interleavedData.clear();
-    opq_indices.clear();
-    trans_indices.clear();
+// A visible face packed into 32 bits: x (4), z (4), y (8), direction (8), block (8)
+static uint32_t packFace(int x, int y, int z, Direction dir, BlockType t) {
+    return static_cast<uint32_t>(x) | (static_cast<uint32_t>(z) << 4) | (static_cast<uint32_t>(y) << 8)
+           | (static_cast<uint32_t>(dir) << 16) | (static_cast<uint32_t>(t) << 24);
+}
 
-    int opq_faceCount = 0;
-    int opq_vertexCount = 0;
+// A face is drawn when the block next to it is empty, or is a different
+// see-through block (water, cactus, ice) or lava.
+static bool faceVisible(BlockType t, BlockType neighbor) {
+    return neighbor == EMPTY || ((isTransparent(neighbor) || neighbor == LAVA) && neighbor != t);
+}
 
-    int trans_faceCount = 0;
-    int trans_vertexCount = 0;
+void Chunk::collectSectionFaces(int section, std::vector<uint32_t> &out) {
+    // Nothing above a column's top block or below the lowest block in
+    // the Chunk can have a face
+    blockMutex.lock();
+    std::array<int, 256> tops = m_columnTops;
+    int minY = std::max(m_minY, SECTION_HEIGHT * section);
+    int maxY = std::min(m_maxY, SECTION_HEIGHT * section + SECTION_HEIGHT - 1);
+    blockMutex.unlock();
 
     for (int x = 0; x < 16; ++x) {
-        for (int y = 0; y < 256; ++y) {
+        for (int y = minY; y <= maxY; ++y) {
             for (int z = 0; z < 16; ++z) {
+                if (y > tops[x + 16 * z]) {
+                    continue;
+                }
                 BlockType t = getLocalBlockAt(x, y, z);
-                glm::vec4 blockPos(x, y, z, 0);
-
-                if (t != EMPTY) {
-                    BlockType x_pos = (x < 15) ? getLocalBlockAt(x + 1, y, z) : (m_neighbors[XPOS] ? m_neighbors[XPOS]->getLocalBlockAt(0, y, z) : EMPTY);
-                    BlockType x_neg = (x > 0) ? getLocalBlockAt(x - 1, y, z) : (m_neighbors[XNEG] ? m_neighbors[XNEG]->getLocalBlockAt(15, y, z) : EMPTY);
-                    BlockType y_pos = (y < 255) ? getLocalBlockAt(x, y + 1, z) : EMPTY;
-                    BlockType y_neg = (y > 0) ? getLocalBlockAt(x, y - 1, z) : EMPTY;
-                    BlockType z_pos = (z < 15) ? getLocalBlockAt(x, y, z + 1) : (m_neighbors[ZPOS] ? m_neighbors[ZPOS]->getLocalBlockAt(x, y, 0) : EMPTY);
-                    BlockType z_neg = (z > 0) ? getLocalBlockAt(x, y, z - 1) : (m_neighbors[ZNEG] ? m_neighbors[ZNEG]->getLocalBlockAt(x, y, 15) : EMPTY);
-
-                    if (x_pos == EMPTY || ((isTransparent(x_pos) || x_pos == LAVA) && x_pos != t)) {
-                        if (!isTransparent(t)) {
-                            updateVBO(opq_interleavedData, XPOS, blockPos, t, opq_vertexCount, opq_indices); opq_faceCount ++; opq_vertexCount += 4;
-                        } else {
-                            updateVBO(trans_interleavedData, XPOS, blockPos, t, trans_vertexCount, trans_indices); trans_faceCount ++; trans_vertexCount += 4;
-                        }
-                    }
-                    if (x_neg == EMPTY || ((isTransparent(x_neg) || x_neg == LAVA) && x_neg != t)) {
-                        if (!isTransparent(t)) {
-                            updateVBO(opq_interleavedData, XNEG, blockPos, t, opq_vertexCount, opq_indices); opq_faceCount ++; opq_vertexCount += 4;;
-                        } else {
-                            updateVBO(trans_interleavedData, XNEG, blockPos, t, trans_vertexCount, trans_indices); trans_faceCount ++; trans_vertexCount += 4;
-                        }
-                    }
-                    if (y_pos == EMPTY || ((isTransparent(y_pos) || y_pos == LAVA) && y_pos != t)) {
-                        if (!isTransparent(t)) {
-                            updateVBO(opq_interleavedData, YPOS, blockPos, t, opq_vertexCount, opq_indices); opq_faceCount ++; opq_vertexCount += 4;
-                        } else {
-                            updateVBO(trans_interleavedData, YPOS, blockPos, t, trans_vertexCount, trans_indices); trans_faceCount ++; trans_vertexCount += 4;
-                        }
-                    }
-                    if (y_neg == EMPTY || ((isTransparent(y_neg)|| y_neg == LAVA) && y_neg != t)) {
-                        if (!isTransparent(t)) {
-                            updateVBO(opq_interleavedData, YNEG, blockPos, t, opq_vertexCount, opq_indices); opq_faceCount ++; opq_vertexCount += 4;
-                        } else {
-                            updateVBO(trans_interleavedData, YNEG, blockPos, t, trans_vertexCount, trans_indices); trans_faceCount ++; trans_vertexCount += 4;
-                        }
-                    }
-                    if (z_pos == EMPTY || ((isTransparent(z_pos) || z_pos == LAVA) && z_pos != t)) {
-                        if (!isTransparent(t)) {
-                            updateVBO(opq_interleavedData, ZPOS, blockPos, t, opq_vertexCount, opq_indices); opq_faceCount ++; opq_vertexCount += 4;
-                        } else {
-                            updateVBO(trans_interleavedData, ZPOS, blockPos, t, trans_vertexCount, trans_indices); trans_faceCount ++; trans_vertexCount += 4;
-                        }
-                    }
-                    if (z_neg == EMPTY || ((isTransparent(z_neg) || z_neg == LAVA) && z_neg != t)) {
-                        if (!isTransparent(t)) {
-                            updateVBO(opq_interleavedData, ZNEG, blockPos, t, opq_vertexCount, opq_indices); opq_faceCount ++; opq_vertexCount += 4;
-                        } else {
-                            updateVBO(trans_interleavedData, ZNEG, blockPos, t, trans_vertexCount, trans_indices); trans_faceCount ++; trans_vertexCount += 4;
-                        }
+                if (t == EMPTY) {
+                    continue;
+                }
+
+                // Indexed by Direction
+                BlockType adjacent[6] = {
+                    (x < 15) ? getLocalBlockAt(x + 1, y, z) : (m_neighbors[XPOS] ? m_neighbors[XPOS]->getLocalBlockAt(0, y, z) : EMPTY),
+                    (x > 0) ? getLocalBlockAt(x - 1, y, z) : (m_neighbors[XNEG] ? m_neighbors[XNEG]->getLocalBlockAt(15, y, z) : EMPTY),
+                    (y < 255) ? getLocalBlockAt(x, y + 1, z) : EMPTY,
+                    (y > 0) ? getLocalBlockAt(x, y - 1, z) : EMPTY,
+                    (z < 15) ? getLocalBlockAt(x, y, z + 1) : (m_neighbors[ZPOS] ? m_neighbors[ZPOS]->getLocalBlockAt(x, y, 0) : EMPTY),
+                    (z > 0) ? getLocalBlockAt(x, y, z - 1) : (m_neighbors[ZNEG] ? m_neighbors[ZNEG]->getLocalBlockAt(x, y, 15) : EMPTY)
+                };
+
+                for (int d = XPOS; d <= ZNEG; ++d) {
+                    if (faceVisible(t, adjacent[d])) {
+                        out.push_back(packFace(x, y, z, static_cast<Direction>(d), t));
                     }
                 }
             }
         }
     }
+}
 
-    /*
-        std::cout << "debug: face count: " << trans_faceCount << std::endl;
-        std::cout << "debug: vertex count: " << trans_vertexCount << std::endl;
-    */
+uint64_t Chunk::findSectionConnections(int section) {
+    const int baseY = SECTION_HEIGHT * section;
+    // Light can pass wherever the mesher would show a face behind
+    std::array<bool, 4096> open;
+    int openCount = 0;
+    blockMutex.lock();
+    if (baseY > m_maxY) {
+        blockMutex.unlock();
+        return SectionInfo::ALL_CONNECTED;
+    }
+    for (int y = 0; y < 16; y++) {
+        for (int z = 0; z < 16; z++) {
+            for (int x = 0; x < 16; x++) {
+                BlockType t = m_blocks[x + 16 * (baseY + y) + 16 * 256 * z];
+                bool o = t == EMPTY || isTransparent(t) || t == LAVA;
+                open[x + 16 * y + 256 * z] = o;
+                openCount += o ? 1 : 0;
+            }
+        }
+    }
+    blockMutex.unlock();
+    if (openCount == 4096) {
+        return SectionInfo::ALL_CONNECTED;
+    }
 
-    working = true;
+    // Flood fill each pocket of open blocks, noting which sides it
+    // reaches; every pair of those sides can see each other
+    uint64_t connections = 0;
+    std::array<bool, 4096> seen{};
+    std::vector<int> stack;
+    for (int start = 0; start < 4096; start++) {
+        if (!open[start] || seen[start]) {
+            continue;
+        }
+        unsigned sides = 0;
+        seen[start] = true;
+        stack.push_back(start);
+        while (!stack.empty()) {
+            int i = stack.back();
+            stack.pop_back();
+            int x = i & 15, y = (i >> 4) & 15, z = i >> 8;
+            sides |= (x == 15 ? 1u << XPOS : 0) | (x == 0 ? 1u << XNEG : 0)
+                     | (y == 15 ? 1u << YPOS : 0) | (y == 0 ? 1u << YNEG : 0)
+                     | (z == 15 ? 1u << ZPOS : 0) | (z == 0 ? 1u << ZNEG : 0);
+            const int next[6] = {x < 15 ? i + 1 : -1, x > 0 ? i - 1 : -1,
+                                 y < 15 ? i + 16 : -1, y > 0 ? i - 16 : -1,
+                                 z < 15 ? i + 256 : -1, z > 0 ? i - 256 : -1};
+            for (int n : next) {
+                if (n >= 0 && open[n] && !seen[n]) {
+                    seen[n] = true;
+                    stack.push_back(n);
+                }
+            }
+        }
+        for (int a = 0; a < 6; a++) {
+            for (int b = 0; b < 6; b++) {
+                if ((sides >> a & 1) && (sides >> b & 1)) {
+                    connections |= uint64_t(1) << (6 * a + b);
+                }
+            }
+        }
+    }
+    return connections;
 }
 
+// The faces and vertex data of one section, with indices counted from
+// the section's own first vertex
+struct SectionMesh {
+    std::vector<uint32_t> faces;
+    std::vector<glm::vec4> opqVerts, transVerts;
+    // Indexed by the Direction the faces face
+    std::array<std::vector<GLuint>, 6> opqIndices, transIndices;
+    uint64_t connections;
+};
 
+void Chunk::generateVBOData(const ParallelFor &parallelFor) {
+    // Faces read from the world store are split up by the section they
+    // sit in; otherwise each section finds its own
+    std::array<SectionMesh, SECTIONS> sections;
+    const bool cached = m_facesCached;
+    if (cached) {
+        for (uint32_t f : m_faces) {
+            sections[((f >> 8) & 0xff) / SECTION_HEIGHT].faces.push_back(f);
+        }
+    }
+    m_facesCached = false;
+
+    // Sections only read blocks and write their own SectionMesh, so
+    // they can be meshed on as many threads as parallelFor likes
+    auto meshSection = [&](int i) {
+        SectionMesh &section = sections[i];
+        if (!cached) {
+            collectSectionFaces(i, section.faces);
+        }
+        section.connections = findSectionConnections(i);
+        for (uint32_t f : section.faces) {
+            glm::vec4 blockPos(f & 0xf, (f >> 8) & 0xff, (f >> 4) & 0xf, 0);
+            Direction dir = static_cast<Direction>((f >> 16) & 0xff);
+            BlockType t = static_cast<BlockType>(f >> 24);
+
+            if (!isTransparent(t)) {
+                updateVBO(section.opqVerts, dir, blockPos, t, section.opqVerts.size() / 3, section.opqIndices[dir]);
+            } else {
+                updateVBO(section.transVerts, dir, blockPos, t, section.transVerts.size() / 3, section.transIndices[dir]);
+            }
+        }
+    };
+    if (parallelFor) {
+        parallelFor(SECTIONS, meshSection);
+    } else {
+        for (int i = 0; i < SECTIONS; i++) {
+            meshSection(i);
+        }
+    }
 
-void Chunk::loadToGPU() {
+    // Stitch the sections' vertices together bottom to top, then their
+    // indices direction by direction, shifting each section's past the
+    // vertices of the sections before it
+    m_faces.clear();
+    opq_interleavedData.clear();
+    trans_interleavedData.clear();
+    opq_indices.clear();
+    trans_indices.clear();
+    std::array<GLuint, SECTIONS> opqBase, transBase;
+    for (int s = 0; s < SECTIONS; s++) {
+        SectionMesh &section = sections[s];
+        m_faces.insert(m_faces.end(), section.faces.begin(), section.faces.end());
+        m_sections[s].connections = section.connections;
+        opqBase[s] = opq_interleavedData.size() / 3;
+        transBase[s] = trans_interleavedData.size() / 3;
+        opq_interleavedData.insert(opq_interleavedData.end(), section.opqVerts.begin(), section.opqVerts.end());
+        trans_interleavedData.insert(trans_interleavedData.end(), section.transVerts.begin(), section.transVerts.end());
+    }
+    for (int d = 0; d < 6; d++) {
+        for (int s = 0; s < SECTIONS; s++) {
+            SectionMesh &section = sections[s];
+            m_sections[s].opqFirst[d] = opq_indices.size();
+            m_sections[s].opqCount[d] = section.opqIndices[d].size();
+            m_sections[s].transFirst[d] = trans_indices.size();
+            m_sections[s].transCount[d] = section.transIndices[d].size();
+            for (GLuint i : section.opqIndices[d]) {
+                opq_indices.push_back(opqBase[s] + i);
+            }
+            for (GLuint i : section.transIndices[d]) {
+                trans_indices.push_back(transBase[s] + i);
+            }
+        }
+    }
 
-    // std::cout << "Loading to GPU" << std::endl;
+    // A face lies in one side of its block, somewhere between the block's
+    // low and high corner
+    glm::ivec3 lo(16, 256, 16), hi(-1);
+    for (uint32_t f : m_faces) {
+        glm::ivec3 block(f & 0xf, (f >> 8) & 0xff, (f >> 4) & 0xf);
+        lo = glm::min(lo, block);
+        hi = glm::max(hi, block);
+    }
+    m_meshMin = glm::vec3(lo) + glm::vec3(minX, 0, minZ);
+    m_meshMax = glm::vec3(hi + 1) + glm::vec3(minX, 0, minZ);
+}
 
-    generateBuffer(OPQ_INTERLEAVED);
-    generateBuffer(OPQ_INDEX);
+const std::vector<uint32_t>& Chunk::getFaces() const {
+    return m_faces;
+}
 
-    if (bindBuffer(OPQ_INTERLEAVED)) {
-        mp_context->glBufferData(GL_ARRAY_BUFFER, opq_interleavedData.size() * sizeof(glm::vec4), opq_interleavedData.data(), GL_STATIC_DRAW);
-    }
+void Chunk::setCachedFaces(std::vector<uint32_t> faces) {
+    m_faces = std::move(faces);
+    m_facesCached = true;
+}
 
-    if (bindBuffer(OPQ_INDEX)) {
-        mp_context->glBufferData(GL_ELEMENT_ARRAY_BUFFER, opq_indices.size() * sizeof(GLuint), opq_indices.data(), GL_STATIC_DRAW);
-    }
-    // std::cout << "debug: 1 index count " << this->elemCount(INDEX) << std::endl;
+void Chunk::dropCachedFaces() {
+    m_facesCached = false;
+}
 
+std::array<BlockType, 65536> Chunk::copyBlocks() {
+    blockMutex.lock();
+    std::array<BlockType, 65536> blocks = m_blocks;
+    blockMutex.unlock();
+    return blocks;
+}
 
-    if (!opq_indices.empty()) {
-        indexCounts[OPQ_INDEX] = opq_indices.size();
-    } else {
-        indexCounts[OPQ_INDEX] = 0;
-    }
+void Chunk::setBlocks(const std::array<BlockType, 65536> &blocks) {
+    blockMutex.lock();
+    m_blocks = blocks;
+    recomputeHeights();
+    blockMutex.unlock();
+}
 
-    if (!opq_interleavedData.empty()) {
-        indexCounts[OPQ_INTERLEAVED] = opq_interleavedData.size();
-    } else {
-        indexCounts[OPQ_INTERLEAVED] = 0;
-    }
 
-    // std::cout << "debug: INTERLEAVED count: " << indexCounts[OPQ_INTERLEAVED] << std::endl;
 
-    generateBuffer(TRANS_INTERLEAVED);
-    generateBuffer(TRANS_INDEX);
+void Chunk::loadToGPU() {
+    adoptBuffers(createBuffers(mp_context));
+}
 
-    if (bindBuffer(TRANS_INTERLEAVED)) {
-        mp_context->glBufferData(GL_ARRAY_BUFFER, trans_interleavedData.size() * sizeof(glm::vec4), trans_interleavedData.data(), GL_STATIC_DRAW);
-    }
+ChunkBuffers Chunk::createBuffers(QOpenGLExtraFunctions *gl) const {
+    GLuint handles[4];
+    gl->glGenBuffers(4, handles);
+    ChunkBuffers b{handles[0], handles[1], handles[2], handles[3],
+                   static_cast<int>(opq_interleavedData.size()), static_cast<int>(opq_indices.size()),
+                   static_cast<int>(trans_interleavedData.size()), static_cast<int>(trans_indices.size()),
+                   m_sections, m_meshMin, m_meshMax};
+
+    // Everything goes through GL_ARRAY_BUFFER: binding an element buffer
+    // needs a VAO, which an upload-only context doesn't have, and GL
+    // doesn't care which target a buffer was filled through
+    gl->glBindBuffer(GL_ARRAY_BUFFER, b.opqVerts);
+    gl->glBufferData(GL_ARRAY_BUFFER, opq_interleavedData.size() * sizeof(glm::vec4), opq_interleavedData.data(), GL_STATIC_DRAW);
+    gl->glBindBuffer(GL_ARRAY_BUFFER, b.opqIndices);
+    gl->glBufferData(GL_ARRAY_BUFFER, opq_indices.size() * sizeof(GLuint), opq_indices.data(), GL_STATIC_DRAW);
+    gl->glBindBuffer(GL_ARRAY_BUFFER, b.transVerts);
+    gl->glBufferData(GL_ARRAY_BUFFER, trans_interleavedData.size() * sizeof(glm::vec4), trans_interleavedData.data(), GL_STATIC_DRAW);
+    gl->glBindBuffer(GL_ARRAY_BUFFER, b.transIndices);
+    gl->glBufferData(GL_ARRAY_BUFFER, trans_indices.size() * sizeof(GLuint), trans_indices.data(), GL_STATIC_DRAW);
+    gl->glBindBuffer(GL_ARRAY_BUFFER, 0);
+    return b;
+}
 
-    if (bindBuffer(TRANS_INDEX)) {
-        mp_context->glBufferData(GL_ELEMENT_ARRAY_BUFFER, trans_indices.size() * sizeof(GLuint), trans_indices.data(), GL_STATIC_DRAW);
+void Chunk::adoptBuffers(const ChunkBuffers &buffers) {
+    for (BufferType t : {OPQ_INTERLEAVED, OPQ_INDEX, TRANS_INTERLEAVED, TRANS_INDEX}) {
+        if (bufGenerated[t]) {
+            mp_context->glDeleteBuffers(1, &bufHandles[t]);
+        }
+        bufGenerated[t] = true;
     }
-
-    if (!trans_indices.empty()) {
-        indexCounts[TRANS_INDEX] = trans_indices.size();
-    } else {
-        indexCounts[TRANS_INDEX] = 0;
+    bufHandles[OPQ_INTERLEAVED] = buffers.opqVerts;
+    bufHandles[OPQ_INDEX] = buffers.opqIndices;
+    bufHandles[TRANS_INTERLEAVED] = buffers.transVerts;
+    bufHandles[TRANS_INDEX] = buffers.transIndices;
+
+    // The VAOs stay, but the buffers they point at are new
+    if (m_opqVAO == 0) {
+        mp_context->glGenVertexArrays(1, &m_opqVAO);
+        mp_context->glGenVertexArrays(1, &m_transVAO);
     }
+    setUpInterleavedVAO(mp_context, m_opqVAO, buffers.opqVerts, buffers.opqIndices);
+    setUpInterleavedVAO(mp_context, m_transVAO, buffers.transVerts, buffers.transIndices);
+    adoptMesh(buffers);
+}
 
-    if (!trans_interleavedData.empty()) {
-        indexCounts[TRANS_INTERLEAVED] = trans_interleavedData.size();
-    } else {
-        indexCounts[TRANS_INTERLEAVED] = 0;
-    }
+void Chunk::adoptMesh(const ChunkBuffers &buffers) {
+    indexCounts[OPQ_INTERLEAVED] = buffers.opqVertCount;
+    indexCounts[OPQ_INDEX] = buffers.opqIndexCount;
+    indexCounts[TRANS_INTERLEAVED] = buffers.transVertCount;
+    indexCounts[TRANS_INDEX] = buffers.transIndexCount;
+    m_drawnSections = buffers.sections;
+    m_drawnMin = buffers.boundsMin;
+    m_drawnMax = buffers.boundsMax;
+    m_onGPU = true;
+}
 
+void Chunk::destroyVBOdata() {
+    Drawable::destroyVBOdata();
+    if (m_opqVAO != 0) {
+        mp_context->glDeleteVertexArrays(1, &m_opqVAO);
+        mp_context->glDeleteVertexArrays(1, &m_transVAO);
+        m_opqVAO = m_transVAO = 0;
+    }
+}
 
-    // std::cout << "debug: interleaved count " << this->elemCount(INTERLEAVED) << std::endl;
-    // std::cout << "debug: 2 index count " << this->elemCount(INDEX) << std::endl;
+GLuint Chunk::vertexArray(BufferType indexBuf) const {
+    return indexBuf == TRANS_INDEX ? m_transVAO : m_opqVAO;
 }
 
 
@@ -2,9 +2,12 @@
 #include "smartpointerhelp.h"
 #include "glm_includes.h"
 #include <array>
+#include <atomic>
 #include <mutex>
 #include <unordered_map>
 #include <cstddef>
+#include <functional>
+#include <vector>
 
 #include <drawable.h>
 
@@ -26,6 +29,66 @@ enum Direction : unsigned char
     XPOS, XNEG, YPOS, YNEG, ZPOS, ZNEG
 };
 
+// The stages of terrain generation, in the order a Chunk goes through them.
+// A Chunk's stage is the last one it has *finished*. Base, surface and caves
+// only touch the Chunk's own columns; decorations may write into any of the
+// eight surrounding Chunks and meshing reads its neighbours, so a Chunk only
+// enters those once every neighbour has finished the stage before.
+// A Chunk's stage stops at DECORATIONS; MESH only labels meshing time in
+// the generation stats, and whether a Chunk has a mesh is its ChunkState.
+enum class GenStage : unsigned char
+{
+    NONE, BASE, SURFACE, CAVES, DECORATIONS, MESH
+};
+
+// Where a Chunk is in its life. Only these moves are allowed:
+//   ALLOCATED  -> GENERATING              a zone starts generating it
+//   GENERATING -> GENERATED               its own decorations are done
+//   GENERATED  -> MESHING, DIRTY -> MESHING   a worker starts building its mesh
+//   MESHING    -> MESHED                  the vertex data is ready to upload
+//   MESHED     -> UPLOADED                the main thread sent it to the GPU
+//   MESHING, MESHED, UPLOADED -> DIRTY    a block changed, the mesh is stale
+//                                         (or a MESHING job was cancelled)
+// An edit while MESHING leaves the Chunk DIRTY, so the mesh being built is
+// thrown away and another is started once that worker is done; any number
+// of edits before then cost one remesh.
+enum class ChunkState : unsigned char
+{
+    ALLOCATED, GENERATING, GENERATED, MESHING, MESHED, UPLOADED, DIRTY
+};
+
+// Where one section's faces sit in its Chunk's index buffers, indexed by
+// the Direction they face, and which of its six sides can see each other
+// through it: bit 6 * a + b of connections is set when there's a path of
+// see-through blocks from side a to side b, for Directions a and b. Used
+// for cave culling.
+struct SectionInfo {
+    std::array<int, 6> opqFirst, opqCount;
+    std::array<int, 6> transFirst, transCount;
+    uint64_t connections;
+
+    // Every side connected to every other
+    static constexpr uint64_t ALL_CONNECTED = (uint64_t(1) << 36) - 1;
+
+    // Indices of every direction, opaque and transparent
+    int indexCount() const {
+        int count = 0;
+        for (int d = 0; d < 6; d++) {
+            count += opqCount[d] + transCount[d];
+        }
+        return count;
+    }
+};
+
+// All six Directions, one bit each
+static constexpr uint8_t ALL_DIRECTIONS = 0x3f;
+
+struct ChunkBuffers;
+
+// Calls body(i) for every i in [0, n), possibly on several threads at
+// once, and returns when all of them have finished
+using ParallelFor = std::function<void(int, const std::function<void(int)>&)>;
+
 // Lets us use any enum class as the key of a
 // std::unordered_map
 struct EnumHash {
@@ -44,6 +107,11 @@ struct EnumHash {
 
 // TODO have Chunk inherit from Drawable
 class Chunk : public Drawable {
+public:
+    // Meshes are built a section at a time: 16 slabs, 16 blocks tall
+    static constexpr int SECTIONS = 16;
+    static constexpr int SECTION_HEIGHT = 16;
+
 private:
     // All of the blocks contained within this Chunk
     std::array<BlockType, 65536> m_blocks;
@@ -56,6 +124,18 @@ private:
     std::unordered_map<Direction, Chunk*, EnumHash> m_neighbors;
     std::mutex blockMutex;
 
+    // Highest non-EMPTY y in each column, or -1 if the column is empty.
+    // Indexed x + 16 * z.
+    std::array<int, 256> m_columnTops;
+    // Lowest and highest occupied y in the whole Chunk (m_maxY is -1 when
+    // it's empty). Removing blocks never raises m_minY, so it's a bound
+    // rather than the exact lowest block.
+    int m_minY, m_maxY;
+
+    // Keep the heights above in step with a write of t at (x, y, z).
+    // Caller holds blockMutex.
+    void updateHeights(int x, int y, int z, BlockType t);
+    void recomputeHeights();
 
 
     std::vector<GLuint> opq_indices;
@@ -64,26 +144,131 @@ private:
     std::vector<GLuint> trans_indices;
     std::vector<glm::vec4> trans_interleavedData;
 
+    // Every visible face found by the last generateVBOData(), packed into
+    // one uint32 each, bottom section first. If m_facesCached is set they
+    // came from the world store and the next generateVBOData() builds
+    // from them as-is.
+    std::vector<uint32_t> m_faces;
+    bool m_facesCached;
+
+    // Appends the visible faces with y in [16 * section, 16 * section + 15]
+    void collectSectionFaces(int section, std::vector<uint32_t> &out);
+    // Which sides of the section can see each other, as in SectionInfo
+    uint64_t findSectionConnections(int section);
+
+    // For each section, from the last generateVBOData() and from the
+    // buffers being drawn. m_drawnSections is only touched by the main thread.
+    std::array<SectionInfo, SECTIONS> m_sections;
+    std::array<SectionInfo, SECTIONS> m_drawnSections;
+    // World-space box around every face of the same two meshes. Empty
+    // (min above max) when there are none.
+    glm::vec3 m_meshMin, m_meshMax;
+    glm::vec3 m_drawnMin, m_drawnMax;
+
+    std::atomic<ChunkState> m_state;
+    // Whether adoptBuffers() or adoptMesh() has run, i.e. there's a mesh to draw.
+    // Only touched by the main thread.
+    bool m_onGPU;
+    // Set up by adoptBuffers() to draw the opaque and transparent buffers.
+    // 0 until then, and for meshes a ChunkRenderer holds.
+    GLuint m_opqVAO, m_transVAO;
+
 public:
-    bool ready;
-    bool loaded;
-    bool working;
+    // Last generation stage this Chunk has finished, and whether a
+    // worker currently owns it for the next stage or a mesh.
+    std::atomic<GenStage> stage;
+    std::atomic<bool> staging;
+    // Jobs holding this Chunk, as their own or as a neighbour. Terrain
+    // doesn't unload a Chunk while any do.
+    std::atomic<int> pins;
+    // Whether the player has changed a block in it. Edited Chunks are
+    // never unloaded, since regenerating them would lose the edit, and
+    // neighbours' decorations are no longer placed in them. Set under
+    // Terrain's chunkMutex.
+    std::atomic<bool> edited;
+
+    ChunkState getState() const;
+    // Moves the Chunk from `from` to `to` if it's still in `from` and
+    // the move is one listed above. Returns whether it moved.
+    bool transition(ChunkState from, ChunkState to);
+    // Call after changing a block: a Chunk with a mesh needs a new one
+    void markDirty();
+    bool hasGPUData() const;
+    // The section as it is in the buffers being drawn. Main thread only.
+    const SectionInfo& drawnSection(int section) const;
+    // The Directions, one bit each, of the faces in the buffers being
+    // drawn that might face eye. A face only does if eye is past the
+    // plane it lies in, so once eye is behind every face plane of a
+    // direction the mesh could have, none of that direction can. Main
+    // thread only.
+    uint8_t facingDirections(glm::vec3 eye) const;
+    // Size of the vertex and index data the last mesh built
+    size_t meshBytes() const;
 
     Chunk(int x, int z, OpenGLContext* context);
     static std::unordered_map<BlockType, glm::vec2> blockUVs;
     static glm::vec2 getUV(BlockType t, Direction dir);
 
     void create();
-    void generateVBOData();
+    // Meshes each section separately and stitches the results together.
+    // With parallelFor set, sections may be meshed on several threads.
+    // The indices are grouped by the Direction their faces face, and then
+    // by section bottom to top, so one direction of a run of sections
+    // is one range.
+    void generateVBOData(const ParallelFor &parallelFor = ParallelFor());
     void loadVBO();
     void loadToGPU();
+    // Creates and fills buffers from the last mesh through gl, which may
+    // belong to a context shared with the main one on another thread.
+    // The mesh mustn't change meanwhile.
+    ChunkBuffers createBuffers(QOpenGLExtraFunctions *gl) const;
+    // Frees this Chunk's buffers and draws from these instead, setting up
+    // a VAO for each index buffer. Main thread only.
+    void adoptBuffers(const ChunkBuffers &buffers);
+    // Takes just the counts and sections of buffers, for a mesh something
+    // else holds and draws. Main thread only.
+    void adoptMesh(const ChunkBuffers &buffers);
     void updateVBO(std::vector<glm::vec4>& interleavedData, Direction dir, const glm::vec4& pos, BlockType t, int vC, std::vector<GLuint>& indices);
 
     void createVBOdata() override;
+    void destroyVBOdata() override;
     GLenum drawMode() override { return GL_TRIANGLES; }
+    GLuint vertexArray(BufferType indexBuf) const override;
 
     BlockType getLocalBlockAt(unsigned int x, unsigned int y, unsigned int z);
     BlockType getLocalBlockAt(int x, int y, int z) ;
     void setLocalBlockAt(unsigned int x, unsigned int y, unsigned int z, BlockType t);
+    // Writes a decoration block only if it outranks what is already there
+    // (WOOD > CACTUS > LEAVES > EMPTY). Terrain is never overwritten, and
+    // the result doesn't depend on which neighbour decorated first.
+    void placeDecorationAt(unsigned int x, unsigned int y, unsigned int z, BlockType t);
+    glm::ivec2 getCorner() const;
+
+    // Highest non-EMPTY local y in column (x, z), or -1 if it has none
+    int getColumnTop(int x, int z);
+    int getMinY();
+    int getMaxY();
+    // World-space box around every occupied block. Returns false if the
+    // Chunk is empty.
+    bool getBounds(glm::vec3 &min, glm::vec3 &max);
+
+    // Bulk block access for the world store
+    std::array<BlockType, 65536> copyBlocks();
+    void setBlocks(const std::array<BlockType, 65536> &blocks);
+    const std::vector<uint32_t>& getFaces() const;
+    void setCachedFaces(std::vector<uint32_t> faces);
+    void dropCachedFaces();
     void linkNeighbor(uPtr<Chunk>& neighbor, Direction dir);
+    // Forgets its neighbours, and they it, before it's unloaded
+    void unlinkNeighbors();
+};
+
+// The GL buffers holding one Chunk mesh, and how much each holds.
+// Buffer names are shared between contexts that share objects, so
+// these can be made on one thread and drawn from on another.
+struct ChunkBuffers {
+    GLuint opqVerts, opqIndices, transVerts, transIndices;
+    int opqVertCount, opqIndexCount, transVertCount, transIndexCount;
+    std::array<SectionInfo, Chunk::SECTIONS> sections;
+    glm::vec3 boundsMin, boundsMax; // Around every face, world space
 };
@@ -0,0 +1,39 @@
+#include "frustum.h"
+
+Frustum::Frustum(const glm::mat4 &viewProj) : m_planes() {
+    // glm is column-major, so row i of the matrix is m[0][i] ... m[3][i]
+    glm::vec4 rows[4];
+    for (int i = 0; i < 4; i++) {
+        rows[i] = glm::vec4(viewProj[0][i], viewProj[1][i], viewProj[2][i], viewProj[3][i]);
+    }
+    m_planes[0] = rows[3] + rows[0];
+    m_planes[1] = rows[3] - rows[0];
+    m_planes[2] = rows[3] + rows[1];
+    m_planes[3] = rows[3] - rows[1];
+    m_planes[4] = rows[3] + rows[2];
+    m_planes[5] = rows[3] - rows[2];
+    for (glm::vec4 &p : m_planes) {
+        p /= glm::length(glm::vec3(p));
+    }
+}
+
+Containment Frustum::classify(const glm::vec3 &min, const glm::vec3 &max) const {
+    Containment result = Containment::INSIDE;
+    for (const glm::vec4 &p : m_planes) {
+        glm::vec3 n(p);
+        // The corners furthest along and against the plane's normal
+        glm::vec3 positive(n.x >= 0 ? max.x : min.x, n.y >= 0 ? max.y : min.y, n.z >= 0 ? max.z : min.z);
+        glm::vec3 negative(n.x >= 0 ? min.x : max.x, n.y >= 0 ? min.y : max.y, n.z >= 0 ? min.z : max.z);
+        if (glm::dot(n, positive) + p.w < 0) {
+            return Containment::OUTSIDE;
+        }
+        if (glm::dot(n, negative) + p.w < 0) {
+            result = Containment::INTERSECTS;
+        }
+    }
+    return result;
+}
+
+bool Frustum::intersects(const glm::vec3 &min, const glm::vec3 &max) const {
+    return classify(min, max) != Containment::OUTSIDE;
+}
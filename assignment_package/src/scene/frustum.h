@@ -0,0 +1,26 @@
+#pragma once
+#include "glm_includes.h"
+#include <array>
+
+// How a box sits relative to a Frustum
+enum class Containment : unsigned char {
+    OUTSIDE, INTERSECTS, INSIDE
+};
+
+// The six planes bounding what a view-projection matrix can see, pulled
+// straight out of the matrix (Gribb and Hartmann). Each plane is stored
+// as (normal, d) with the normal pointing into the volume, so a point p
+// is on the visible side when dot(normal, p) + d >= 0.
+class Frustum {
+private:
+    // Left, right, bottom, top, near, far
+    std::array<glm::vec4, 6> m_planes;
+
+public:
+    explicit Frustum(const glm::mat4 &viewProj);
+
+    // Conservative: a box near a corner of the frustum may be reported
+    // as intersecting when it's really just outside
+    Containment classify(const glm::vec3 &min, const glm::vec3 &max) const;
+    bool intersects(const glm::vec3 &min, const glm::vec3 &max) const;
+};
@@ -0,0 +1,42 @@
+#include "placement.h"
+#include <algorithm>
+
+// Floor division, so cells line up across negative coordinates
+static int floorDiv(int a, int b) {
+    return (a >= 0) ? a / b : -((-a + b - 1) / b);
+}
+
+// Integer hash of a cell (the lowbias32 finalizer)
+static uint32_t hashCell(int cx, int cz, uint32_t seed, uint32_t salt) {
+    uint32_t h = static_cast<uint32_t>(cx) * 0x8da6b343u ^ static_cast<uint32_t>(cz) * 0xd8163841u ^ seed * 0xcb1ab31fu ^ salt;
+    h ^= h >> 16;
+    h *= 0x7feb352du;
+    h ^= h >> 15;
+    h *= 0x846ca68bu;
+    h ^= h >> 16;
+    return h;
+}
+
+PlacementGrid::PlacementGrid(int spacing, int margin, float density, uint32_t seed)
+    : m_spacing(std::max(1, spacing)),
+      m_margin(std::clamp(margin, 0, (std::max(1, spacing) - 1) / 2)),
+      m_threshold(static_cast<uint32_t>(std::clamp(density, 0.f, 1.f) * 4294967295.0)),
+      m_seed(seed)
+{}
+
+void PlacementGrid::sitesIn(int minX, int minZ, int maxX, int maxZ, std::vector<PlacementSite> &out) const {
+    const int span = m_spacing - 2 * m_margin;
+    for (int cx = floorDiv(minX, m_spacing); cx * m_spacing < maxX; cx++) {
+        for (int cz = floorDiv(minZ, m_spacing); cz * m_spacing < maxZ; cz++) {
+            if (hashCell(cx, cz, m_seed, 0) > m_threshold) {
+                continue;
+            }
+            uint32_t h = hashCell(cx, cz, m_seed, 1);
+            int x = cx * m_spacing + m_margin + static_cast<int>(h % span);
+            int z = cz * m_spacing + m_margin + static_cast<int>((h >> 16) % span);
+            if (x >= minX && x < maxX && z >= minZ && z < maxZ) {
+                out.push_back({x, z, hashCell(cx, cz, m_seed, 2)});
+            }
+        }
+    }
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+// One spot picked for a decoration or structure, in world space.
+// variant is a per-site random number the caller can use to vary
+// whatever it puts there (height, rotation, ...).
+struct PlacementSite {
+    int x, z;
+    uint32_t variant;
+};
+
+// Scatters sites over the x-z plane on a jittered grid. The plane is split
+// into square cells of side `spacing`; each cell gets at most one site, at
+// an offset hashed from the cell's coordinates and the seed. Offsets stay at
+// least `margin` blocks inside their cell, so sites in neighbouring cells
+// are never closer than 2 * margin, much like Poisson-disk sampling.
+//
+// A site depends only on its own cell, so any two regions agree on the sites
+// they share: zones and Chunks tile with no seams, in any order. Querying a
+// region costs one hash per cell it overlaps rather than a test per column.
+class PlacementGrid {
+private:
+    int m_spacing;
+    int m_margin;
+    // Chance that a cell holds a site at all, out of 2^32
+    uint32_t m_threshold;
+    uint32_t m_seed;
+
+public:
+    PlacementGrid(int spacing, int margin, float density, uint32_t seed);
+
+    // Appends every site with minX <= x < maxX and minZ <= z < maxZ
+    void sitesIn(int minX, int minZ, int maxX, int maxZ, std::vector<PlacementSite> &out) const;
+};
@@ -3,6 +3,9 @@
 #include "camera.h"
 #include "terrain.h"
 
+// Where a new Player starts out
+const glm::vec3 PLAYER_SPAWN(47.f, 164.f, 170.f);
+
 // Enum of movement modes for the player
 enum class MovementMode {
     WALKING,
@@ -1,20 +1,40 @@
 #include "terrain.h"
+#include "placement.h"
 #include "cube.h"
 #include <random>
 #include <stdexcept>
 #include <iostream>
 #include <thread>
+#include <algorithm>
+#include <chrono>
+#include <limits>
 
 Terrain::Terrain(OpenGLContext *context)
-    : m_chunks(), m_generatedTerrain(),
+    : m_chunks(), m_zones(), zoneMutex(), m_zoneStats(),
+      m_maxZonesInFlight(std::numeric_limits<int>::max()),
       chunkMutex(),
-        mp_context(context)
+        mp_context(context),
+      m_launchJob([](glm::vec2, std::function<void()> job) { std::thread(std::move(job)).detach(); }),
+      m_parallelFor(),
+      m_genStats(), mp_store(nullptr), m_meshingEnabled(true),
+      m_uploadByteBudget(4 << 20), m_uploadTimeBudgetMs(3.0), m_uploadStats(), mp_uploader(nullptr), mp_renderer(nullptr), m_cullStats(),
+      m_interestCenter(0.f), m_interestHalfSize(std::numeric_limits<float>::infinity()), interestMutex(),
+      m_interestMoved(false), m_changedChunks(), m_meshedChunks(), m_parkedChunks(), m_uploadBacklog(),
+      m_meshChanges(), m_unloadedChunks(), m_retiringChunks()
 {}
 
 Terrain::~Terrain(){
     for (auto &chunkPair : m_chunks) {
         chunkPair.second->destroyVBOdata();
     }
+    std::vector<Chunk*> unloaded;
+    m_unloadedChunks.drain(unloaded);
+    for (Chunk *c : unloaded) {
+        m_retiringChunks.push_back(uPtr<Chunk>(c));
+    }
+    for (uPtr<Chunk> &c : m_retiringChunks) {
+        c->destroyVBOdata();
+    }
 }
 
 
@@ -36,6 +56,11 @@ int64_t toKey(int x, int z) {
     return xz;
 }
 
+glm::ivec2 zoneAround(float x, float z) {
+    return glm::ivec2((x - 32) - ((int)(x - 32) % 64),
+                      (z - 32) - ((int)(z - 32) % 64));
+}
+
 glm::ivec2 toCoords(int64_t k) {
     // Z is lower 32 bits
     int64_t z = k & 0x00000000ffffffff;
@@ -59,6 +84,7 @@ BlockType Terrain::getGlobalBlockAt(int x, int y, int z)
         // Just disallow action below or above min/max height,
         // but don't crash the game over it.
         if(y < 0 || y >= 256) {
+            chunkMutex.unlock();
             return EMPTY;
         }
         const uPtr<Chunk> &c = getChunkAt(x, z);
@@ -81,6 +107,38 @@ BlockType Terrain::getGlobalBlockAt(glm::vec3 p) {
     return getGlobalBlockAt(p.x, p.y, p.z);
 }
 
+bool Terrain::findGlobalBlockAt(int x, int y, int z, BlockType &out) {
+    chunkMutex.lock();
+    auto it = m_chunks.find(toKey(16 * static_cast<int>(glm::floor(x / 16.f)), 16 * static_cast<int>(glm::floor(z / 16.f))));
+    bool found = it != m_chunks.end();
+    if (found) {
+        glm::ivec2 corner = it->second->getCorner();
+        out = y < 0 || y >= 256 ? EMPTY : it->second->getLocalBlockAt(x - corner.x, y, z - corner.y);
+    }
+    chunkMutex.unlock();
+    return found;
+}
+
+bool Terrain::hasMeshAt(int x, int z) {
+    chunkMutex.lock();
+    auto it = m_chunks.find(toKey(16 * static_cast<int>(glm::floor(x / 16.f)), 16 * static_cast<int>(glm::floor(z / 16.f))));
+    bool meshed = it != m_chunks.end() && it->second->hasGPUData();
+    chunkMutex.unlock();
+    return meshed;
+}
+
+int Terrain::getSurfaceHeight(int x, int z) {
+    chunkMutex.lock();
+    int top = -1;
+    if(hasChunkAt(x, z)) {
+        const uPtr<Chunk> &c = getChunkAt(x, z);
+        glm::ivec2 corner = c->getCorner();
+        top = c->getColumnTop(x - corner.x, z - corner.y);
+    }
+    chunkMutex.unlock();
+    return top;
+}
+
 bool Terrain::hasChunkAt(int x, int z) {
     // Map x and z to their nearest Chunk corner
     // By flooring x and z, then multiplying by 16,
@@ -104,12 +162,11 @@ uPtr<Chunk>& Terrain::getChunkAt(int x, int z) {
 }
 
 bool Terrain::hasTerrainAt(int x, int z) {
-    if(m_generatedTerrain.count(toKey(x, z)) > 0) {
-        return true;
-    }
-    else {
-        return false;
-    }
+    zoneMutex.lock();
+    auto it = m_zones.find(toKey(x, z));
+    bool found = it != m_zones.end() && (it->second == ZoneState::IN_PROGRESS || it->second == ZoneState::DONE);
+    zoneMutex.unlock();
+    return found;
 }
 
 
@@ -129,9 +186,23 @@ void Terrain::setGlobalBlockAt(int x, int y, int z, BlockType t)
                            static_cast<unsigned int>(y),
                            static_cast<unsigned int>(z - chunkOrigin.y),
                            t);
-        // c->createVBOdata();
+        // This Chunk's mesh is stale, and so are its neighbours' if the
+        // block sat on the border. That includes faces read from the store.
+        c->dropCachedFaces();
+        c->markDirty();
+        c->edited = true;
+        m_changedChunks.push(c.get());
+        for (glm::ivec2 d : {glm::ivec2(1, 0), glm::ivec2(-1, 0), glm::ivec2(0, 1), glm::ivec2(0, -1)}) {
+            if (hasChunkAt(x + d.x, z + d.y)) {
+                Chunk *n = getChunkAt(x + d.x, z + d.y).get();
+                if (n != c.get()) {
+                    n->dropCachedFaces();
+                    n->markDirty();
+                    m_changedChunks.push(n);
+                }
+            }
+        }
         chunkMutex.unlock();
-        c->loaded = false;
     }
     else {
         chunkMutex.unlock();
@@ -141,29 +212,140 @@ void Terrain::setGlobalBlockAt(int x, int y, int z, BlockType t)
     }
 }
 
-void Terrain::loadChunkVBOs() {
-    for (const auto& [key, value] : m_chunks) {
-        if(value->ready && !value->loaded) {
-            std::cout << "Creating VBO Data" << std::endl;
-            value->ready = false;
-            value->working = false;
-            auto x = value.get();
-            auto f = [x]() {
-                std::cout << "Beginning VBO data Generation" << std::endl;
-                x->generateVBOData();
-            };
-
-            auto VBOWorker = std::thread(f);
-            VBOWorker.detach();
+void Terrain::loadChunkVBOs(glm::vec2 viewer) {
+    // A MESHED Chunk only leaves MESHED through an edit, which happens on
+    // this same thread, so no worker can be rewriting these meshes while
+    // they upload
+    auto start = std::chrono::steady_clock::now();
+    m_uploadStats = UploadStats();
+    std::vector<Chunk*> unloaded;
+    m_unloadedChunks.drain(unloaded);
+    for (Chunk *c : unloaded) {
+        m_retiringChunks.push_back(uPtr<Chunk>(c));
+    }
+    std::unordered_set<const Chunk*> retiring;
+    for (const uPtr<Chunk> &c : m_retiringChunks) {
+        retiring.insert(c.get());
+    }
+    if (mp_uploader != nullptr) {
+        // Swap in whatever the upload thread has finished
+        std::vector<GLUploader::Finished> finished;
+        mp_uploader->collect(finished);
+        for (GLUploader::Finished &f : finished) {
+            if (retiring.count(f.chunk) > 0) {
+                // Unloaded while it uploaded; nothing will draw it
+                GLuint handles[4] = {f.buffers.opqVerts, f.buffers.opqIndices, f.buffers.transVerts, f.buffers.transIndices};
+                mp_context->glDeleteBuffers(4, handles);
+                f.chunk->staging = false;
+                continue;
+            }
+            adoptBuffers(f.chunk, f.buffers);
+            f.chunk->staging = false;
+            if (!f.chunk->transition(ChunkState::MESHED, ChunkState::UPLOADED)) {
+                // Edited while it uploaded; the scheduler remeshes it now
+                // the upload has let go of its mesh
+                m_changedChunks.push(f.chunk);
+            }
         }
+        m_uploadStats.inFlight = mp_uploader->inFlight();
+    }
 
-        if(value->working) { ///DONE WORKING
-            // std::cout << "mew" << std::endl;
-            value->loadToGPU();
-            value->working = false;
-            value->loaded = true;
+    // Only Chunks meshed since the last call, and whatever the budget
+    // held back then, are looked at
+    m_meshedChunks.drain(m_uploadBacklog);
+    if (!retiring.empty()) {
+        m_uploadBacklog.erase(std::remove_if(m_uploadBacklog.begin(), m_uploadBacklog.end(),
+                                             [&](Chunk *c) { return retiring.count(c) > 0; }),
+                              m_uploadBacklog.end());
+        // Nothing else here refers to them now, bar an upload in flight
+        auto stillUploading = std::stable_partition(m_retiringChunks.begin(), m_retiringChunks.end(),
+                                                    [](const uPtr<Chunk> &c) { return c->staging.load(); });
+        for (auto it = stillUploading; it != m_retiringChunks.end(); ++it) {
+            if (mp_renderer != nullptr) {
+                mp_renderer->remove(it->get());
+            }
+            (*it)->destroyVBOdata();
+            m_meshChanges.push_back((*it)->getCorner());
+            m_uploadStats.released++;
+        }
+        m_retiringChunks.erase(stillUploading, m_retiringChunks.end());
+    }
+    std::vector<std::pair<float, Chunk*>> meshed;
+    for (Chunk *c : m_uploadBacklog) {
+        // One edited since it was meshed comes back through the queue
+        if(c->getState() == ChunkState::MESHED) {
+            glm::vec2 center = glm::vec2(c->getCorner()) + 8.f;
+            meshed.push_back({glm::distance(center, viewer), c});
         }
     }
+    std::sort(meshed.begin(), meshed.end(),
+              [](const std::pair<float, Chunk*> &a, const std::pair<float, Chunk*> &b) { return a.first < b.first; });
+
+    size_t i = 0;
+    for (; i < meshed.size(); i++) {
+        Chunk *c = meshed[i].second;
+        if (c->getState() != ChunkState::MESHED || c->staging) {
+            continue; // Remeshed before its first upload, so queued twice
+        }
+        double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        size_t bytes = c->meshBytes();
+        if (m_uploadStats.uploads > 0
+            && (m_uploadStats.bytes + bytes > m_uploadByteBudget || elapsed >= m_uploadTimeBudgetMs)) {
+            break;
+        }
+        if (mp_uploader != nullptr) {
+            // The scheduler won't remesh a Chunk it sees staging, so its
+            // mesh stays put until the upload comes back
+            c->staging = true;
+            mp_uploader->upload(c);
+        } else {
+            adoptBuffers(c, c->createBuffers(mp_context));
+            c->transition(ChunkState::MESHED, ChunkState::UPLOADED);
+        }
+        m_uploadStats.uploads++;
+        m_uploadStats.bytes += bytes;
+    }
+    m_uploadBacklog.clear();
+    for (; i < meshed.size(); i++) {
+        m_uploadBacklog.push_back(meshed[i].second);
+    }
+    m_uploadStats.backlog = m_uploadBacklog.size();
+    m_uploadStats.millis = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+void Terrain::setUploader(GLUploader *uploader) {
+    mp_uploader = uploader;
+}
+
+void Terrain::setChunkRenderer(ChunkRenderer *renderer) {
+    mp_renderer = renderer;
+}
+
+void Terrain::adoptBuffers(Chunk *c, const ChunkBuffers &buffers) {
+    if (mp_renderer != nullptr) {
+        // The Chunk's own buffers were only the way onto the GPU
+        mp_renderer->store(c, buffers);
+        GLuint handles[4] = {buffers.opqVerts, buffers.opqIndices, buffers.transVerts, buffers.transIndices};
+        mp_context->glDeleteBuffers(4, handles);
+        c->adoptMesh(buffers);
+    } else {
+        c->adoptBuffers(buffers);
+    }
+    m_meshChanges.push_back(c->getCorner());
+}
+
+void Terrain::setUploadBudget(size_t bytes, double millis) {
+    m_uploadByteBudget = bytes;
+    m_uploadTimeBudgetMs = millis;
+}
+
+const UploadStats& Terrain::uploadStats() const {
+    return m_uploadStats;
+}
+
+void Terrain::takeMeshChanges(std::vector<glm::ivec2> &out) {
+    out.clear();
+    out.swap(m_meshChanges);
 }
 
 Chunk* Terrain::instantiateChunkAt(int x, int z) {
@@ -192,34 +374,321 @@ Chunk* Terrain::instantiateChunkAt(int x, int z) {
     return cPtr;
 }
 
-// TODO: When you make Chunk inherit from Drawable, change this code so
-// it draws each Chunk with the given ShaderProgram
-void Terrain::draw(int minX, int maxX, int minZ, int maxZ, ShaderProgram *shaderProgram, bool opq, bool trans) {
+void Terrain::findVisible(int minX, int maxX, int minZ, int maxZ, const CullView *view, VisibleSet &out) {
+    minX = 16 * static_cast<int>(glm::floor(minX / 16.f));
+    minZ = 16 * static_cast<int>(glm::floor(minZ / 16.f));
+    const int nx = (maxX - minX + 15) / 16;
+    const int nz = (maxZ - minZ + 15) / 16;
+    const Frustum *frustum = view != nullptr ? &view->frustum : nullptr;
+
+    // Shadow casters can lie outside the camera's area, so the area looked
+    // at grows to take in the part of each caster volume within the
+    // world's height
+    struct Caster {
+        int cascade;
+        Frustum frustum;
+        glm::vec2 lo, hi; // x-z bounds
+    };
+    std::vector<Caster> casters;
+    glm::vec2 areaLo(minX, minZ), areaHi(minX + 16 * nx, minZ + 16 * nz);
+    if (view != nullptr) {
+        for (const ShadowView &shadow : view->shadows) {
+            // The volume's a box in light space, so its edges along the
+            // light's direction are straight lines in the world too
+            glm::mat4 inv = glm::inverse(shadow.casterViewProj);
+            Caster caster{shadow.cascade, Frustum(shadow.casterViewProj), glm::vec2(1e30f), glm::vec2(-1e30f)};
+            for (int corner = 0; corner < 4; corner++) {
+                glm::vec2 ndc((corner & 1) ? 1.f : -1.f, (corner & 2) ? 1.f : -1.f);
+                glm::vec3 a = glm::vec3(inv * glm::vec4(ndc, -1.f, 1.f));
+                glm::vec3 b = glm::vec3(inv * glm::vec4(ndc, 1.f, 1.f));
+                float t0 = 0.f, t1 = 1.f;
+                if (a.y != b.y) {
+                    float tLo = (0.f - a.y) / (b.y - a.y), tHi = (256.f - a.y) / (b.y - a.y);
+                    t0 = std::max(t0, std::min(tLo, tHi));
+                    t1 = std::min(t1, std::max(tLo, tHi));
+                } else if (a.y < 0.f || a.y > 256.f) {
+                    continue;
+                }
+                if (t0 > t1) {
+                    continue;
+                }
+                for (float t : {t0, t1}) {
+                    glm::vec3 p = glm::mix(a, b, t);
+                    caster.lo = glm::min(caster.lo, glm::vec2(p.x, p.z));
+                    caster.hi = glm::max(caster.hi, glm::vec2(p.x, p.z));
+                }
+            }
+            if (caster.lo.x > caster.hi.x) {
+                continue; // All above or below the world
+            }
+            areaLo = glm::min(areaLo, caster.lo);
+            areaHi = glm::max(areaHi, caster.hi);
+            casters.push_back(caster);
+        }
+    }
+    const int areaMinX = 16 * static_cast<int>(glm::floor(areaLo.x / 16.f));
+    const int areaMinZ = 16 * static_cast<int>(glm::floor(areaLo.y / 16.f));
+    const int areaNx = static_cast<int>(glm::ceil((areaHi.x - areaMinX) / 16.f));
+    const int areaNz = static_cast<int>(glm::ceil((areaHi.y - areaMinZ) / 16.f));
+    // Where the camera's area starts within it
+    const int offI = (minX - areaMinX) / 16;
+    const int offJ = (minZ - areaMinZ) / 16;
+
+    // Look the Chunks up while holding chunkMutex, as workers may be
+    // adding Chunks meanwhile, then cull them without it
+    std::vector<Chunk*> area(areaNx * areaNz, nullptr);
+    chunkMutex.lock();
+    for (int i = 0; i < areaNx; i++) {
+        for (int j = 0; j < areaNz; j++) {
+            if (hasChunkAt(areaMinX + 16 * i, areaMinZ + 16 * j)) {
+                area[i + areaNx * j] = getChunkAt(areaMinX + 16 * i, areaMinZ + 16 * j).get();
+            }
+        }
+    }
+    chunkMutex.unlock();
+    // The camera's area, on its own
+    std::vector<Chunk*> grid(nx * nz, nullptr);
+    for (int i = 0; i < nx; i++) {
+        for (int j = 0; j < nz; j++) {
+            grid[i + nx * j] = area[(offI + i) + areaNx * (offJ + j)];
+        }
+    }
 
-    if (opq) {
-        for(int x = minX; x < maxX; x += 16) {
-            for(int z = minZ; z < maxZ; z += 16) {
-                if (hasChunkAt(x, z)) {
-                    const uPtr<Chunk> &chunk = getChunkAt(x, z);
-                    if(chunk->loaded) {
-                        shaderProgram->drawOpq(*chunk);
+    // Sections to draw of each Chunk in the grid, one bit per section
+    std::vector<uint16_t> sections(nx * nz, 0);
+    CullStats stats;
+    auto consider = [&](int i, int j, bool test) {
+        Chunk *c = grid[i + nx * j];
+        if (c == nullptr || !c->hasGPUData()) {
+            return;
+        }
+        if (test) {
+            stats.chunksTested++;
+            glm::vec3 lo, hi;
+            if (!c->getBounds(lo, hi) || !frustum->intersects(lo, hi)) {
+                return;
+            }
+        }
+        sections[i + nx * j] = 0xffff;
+    };
+
+    const int groupChunks = CULL_GROUP_SIZE / 16;
+    if (frustum != nullptr && std::max(maxX - minX, maxZ - minZ) >= CULL_GROUP_MIN_SPAN) {
+        // Far enough out that most of the area is behind the camera or off
+        // to the side: test whole zones first, and only look at the Chunks
+        // of the ones the frustum cuts through
+        for (int gi = 0; gi < nx; gi += groupChunks) {
+            for (int gj = 0; gj < nz; gj += groupChunks) {
+                int gMaxI = std::min(gi + groupChunks, nx);
+                int gMaxJ = std::min(gj + groupChunks, nz);
+                stats.groupsTested++;
+                Containment group = frustum->classify(glm::vec3(minX + 16 * gi, 0, minZ + 16 * gj),
+                                                      glm::vec3(minX + 16 * gMaxI, 256, minZ + 16 * gMaxJ));
+                if (group == Containment::OUTSIDE) {
+                    continue;
+                }
+                for (int i = gi; i < gMaxI; i++) {
+                    for (int j = gj; j < gMaxJ; j++) {
+                        consider(i, j, group == Containment::INTERSECTS);
                     }
                 }
             }
         }
+    } else {
+        for (int i = 0; i < nx; i++) {
+            for (int j = 0; j < nz; j++) {
+                consider(i, j, frustum != nullptr);
+            }
+        }
     }
-    if (trans) {
-        for(int x = minX; x < maxX; x += 16) {
-            for(int z = minZ; z < maxZ; z += 16) {
-                if (hasChunkAt(x, z)) {
-                    const uPtr<Chunk> &chunk = getChunkAt(x, z);
-                    if(chunk->loaded) {
-                        shaderProgram->drawTrans(*chunk);
+
+    const int eyeI = static_cast<int>(glm::floor(view != nullptr ? (view->eye.x - minX) / 16.f : -1.f));
+    const int eyeJ = static_cast<int>(glm::floor(view != nullptr ? (view->eye.z - minZ) / 16.f : -1.f));
+    const int eyeS = static_cast<int>(glm::floor(view != nullptr ? view->eye.y / Chunk::SECTION_HEIGHT : -1.f));
+    if (view != nullptr && view->caves && eyeI >= 0 && eyeI < nx && eyeJ >= 0 && eyeJ < nz && eyeS >= 0 && eyeS < Chunk::SECTIONS) {
+        // Cave culling: walk out from the camera's section, passing through
+        // a section from one side to another only if see-through blocks
+        // connect them, and never heading back towards the camera. Sections
+        // the walk can't reach can't be seen. Chunks without a mesh yet
+        // are taken to be open.
+        struct Step {
+            int i, s, j;
+            int from;       // side we came in through, or -1 at the camera
+            unsigned moved; // directions taken to get here
+        };
+        static const glm::ivec3 offsets[6] = {{1, 0, 0}, {-1, 0, 0}, {0, 1, 0}, {0, -1, 0}, {0, 0, 1}, {0, 0, -1}};
+        std::vector<uint16_t> reached(nx * nz, 0);
+        std::vector<Step> queue = {{eyeI, eyeS, eyeJ, -1, 0}};
+        reached[eyeI + nx * eyeJ] |= 1 << eyeS;
+        for (size_t head = 0; head < queue.size(); head++) {
+            Step step = queue[head];
+            Chunk *c = grid[step.i + nx * step.j];
+            uint64_t connections = c != nullptr && c->hasGPUData() ? c->drawnSection(step.s).connections : SectionInfo::ALL_CONNECTED;
+            for (int d = 0; d < 6; d++) {
+                int back = d ^ 1; // XPOS <-> XNEG and so on
+                if ((step.moved >> back & 1) || (step.from >= 0 && !(connections >> (6 * step.from + d) & 1))) {
+                    continue;
+                }
+                Step next{step.i + offsets[d].x, step.s + offsets[d].y, step.j + offsets[d].z, back, step.moved | 1u << d};
+                if (next.i < 0 || next.i >= nx || next.j < 0 || next.j >= nz || next.s < 0 || next.s >= Chunk::SECTIONS
+                    || (reached[next.i + nx * next.j] >> next.s & 1)) {
+                    continue;
+                }
+                glm::vec3 lo(minX + 16 * next.i, Chunk::SECTION_HEIGHT * next.s, minZ + 16 * next.j);
+                if (!frustum->intersects(lo, lo + glm::vec3(16, Chunk::SECTION_HEIGHT, 16))) {
+                    continue;
+                }
+                reached[next.i + nx * next.j] |= 1 << next.s;
+                queue.push_back(next);
+            }
+        }
+
+        for (int k = 0; k < nx * nz; k++) {
+            for (int s = 0; s < Chunk::SECTIONS; s++) {
+                if ((sections[k] >> s & 1) && !(reached[k] >> s & 1)) {
+                    const SectionInfo &info = grid[k]->drawnSection(s);
+                    stats.sectionsHidden += info.indexCount() > 0 ? 1 : 0;
+                }
+            }
+            sections[k] &= reached[k];
+        }
+    }
+
+    // Shadows can fall into view from Chunks the camera can't see, so
+    // each cascade draws whatever its casters are, seen or not
+    out.clear();
+    for (int i = 0; i < areaNx; i++) {
+        for (int j = 0; j < areaNz; j++) {
+            Chunk *c = area[i + areaNx * j];
+            if (c == nullptr || !c->hasGPUData()) {
+                continue;
+            }
+            uint8_t passes = 0;
+            uint16_t cameraSections = 0;
+            uint8_t directions = ALL_DIRECTIONS;
+            int ci = i - offI, cj = j - offJ;
+            if (ci >= 0 && ci < nx && cj >= 0 && cj < nz && sections[ci + nx * cj] != 0) {
+                cameraSections = sections[ci + nx * cj];
+                passes |= PASS_CAMERA;
+                stats.chunksDrawn++;
+                if (view != nullptr) {
+                    // Opaque faces' backs are always hidden inside their
+                    // blocks, so those facing away needn't be drawn
+                    directions = c->facingDirections(view->eye);
+                }
+                for (int s = 0; s < Chunk::SECTIONS; s++) {
+                    if (cameraSections >> s & 1) {
+                        const SectionInfo &info = c->drawnSection(s);
+                        for (int d = 0; d < 6; d++) {
+                            stats.opaqueFaces += info.opqCount[d] / 6;
+                            stats.facesSkipped += (directions >> d & 1) ? 0 : info.opqCount[d] / 6;
+                        }
+                    }
+                }
+            }
+            glm::vec3 lo, hi;
+            if (!casters.empty() && c->getBounds(lo, hi)) {
+                for (const Caster &caster : casters) {
+                    if (lo.x > caster.hi.x || hi.x < caster.lo.x || lo.z > caster.hi.y || hi.z < caster.lo.y) {
+                        continue;
+                    }
+                    stats.castersTested++;
+                    if (caster.frustum.intersects(lo, hi)) {
+                        passes |= shadowPass(caster.cascade);
+                        stats.castersFound[caster.cascade]++;
+                    }
+                }
+            }
+            if (passes != 0) {
+                out.push_back({c, passes, cameraSections, directions});
+            }
+        }
+    }
+    m_cullStats = stats;
+}
+
+void Terrain::draw(const VisibleSet &visible, ShaderProgram *shaderProgram, RenderPass pass, bool opq, bool trans) {
+
+    // Within each direction, sections are stored bottom to top, so each
+    // run of neighbouring sections to draw is one contiguous range of
+    // indices, and so is a run that carries on into the next direction
+    // With a renderer they're queued up and all go out in one call
+    auto drawRange = [&](Chunk *c, bool transparent, int first, int count) {
+        if (mp_renderer != nullptr) {
+            mp_renderer->queue(c, transparent, first, count);
+        } else if (transparent) {
+            shaderProgram->drawTrans(*c, first, count);
+        } else {
+            shaderProgram->drawOpq(*c, first, count);
+        }
+    };
+    auto drawSections = [&](Chunk *c, uint16_t mask, uint8_t directions, bool transparent) {
+        if (mask == 0xffff && directions == ALL_DIRECTIONS) {
+            drawRange(c, transparent, 0, -1);
+            return;
+        }
+        int from = 0, to = 0; // The range waiting to be drawn
+        for (int d = 0; d < 6; d++) {
+            if (!(directions >> d & 1)) {
+                continue;
+            }
+            for (int s = 0; s < Chunk::SECTIONS;) {
+                if (!(mask >> s & 1)) {
+                    s++;
+                    continue;
+                }
+                int end = s;
+                while (end + 1 < Chunk::SECTIONS && (mask >> (end + 1) & 1)) {
+                    end++;
+                }
+                const SectionInfo &first = c->drawnSection(s);
+                const SectionInfo &last = c->drawnSection(end);
+                int runFrom = transparent ? first.transFirst[d] : first.opqFirst[d];
+                int runTo = transparent ? last.transFirst[d] + last.transCount[d] : last.opqFirst[d] + last.opqCount[d];
+                if (runTo > runFrom) {
+                    if (runFrom != to) {
+                        if (to > from) {
+                            drawRange(c, transparent, from, to - from);
+                        }
+                        from = runFrom;
                     }
+                    to = runTo;
                 }
+                s = end + 1;
+            }
+        }
+        if (to > from) {
+            drawRange(c, transparent, from, to - from);
+        }
+    };
+    // The camera pass draws what cave culling left of each Chunk, and of
+    // that only the opaque faces that might face it
+    if (opq) {
+        for (const VisibleChunk &v : visible) {
+            if (v.passes & pass) {
+                drawSections(v.chunk, pass == PASS_CAMERA ? v.sections : 0xffff,
+                             pass == PASS_CAMERA ? v.directions : ALL_DIRECTIONS, false);
             }
         }
+        if (mp_renderer != nullptr) {
+            mp_renderer->flush(*shaderProgram, false);
+        }
     }
+    if (trans) {
+        for (const VisibleChunk &v : visible) {
+            if (v.passes & pass) {
+                // Water and the like show their backs
+                drawSections(v.chunk, pass == PASS_CAMERA ? v.sections : 0xffff, ALL_DIRECTIONS, true);
+            }
+        }
+        if (mp_renderer != nullptr) {
+            mp_renderer->flush(*shaderProgram, true);
+        }
+    }
+}
+
+const CullStats& Terrain::cullStats() const {
+    return m_cullStats;
 }
 
 
@@ -229,274 +698,641 @@ float noise(int x, int y) ;
 float distanceToVoronoiEdge(float x, float y, int seed);
 
 
-void Terrain::GenerateTerrain(int xPos, int zPos)  {
+// The large-scale noise that decides what a column of terrain looks like.
+// Surface and decoration both need it, so it lives in one place.
+enum class Biome : unsigned char { LOWLAND, DESERT, GRASSLAND, MOUNTAINS };
+
+struct ColumnSample {
+    Biome biome;
+    float typeTerrain;
+    float threshold; // height of the biome's surface (unused for LOWLAND)
+    float riverDist;
+};
+
+static ColumnSample sampleColumn(int x, int z) {
+    ColumnSample s;
+    s.typeTerrain = 40 * PerlinNoise(x * 0.003, 12, z * 0.003) + 129;
+    const float terrain_perlin = PerlinNoise(x * 0.02, 12.23, z * 0.02);
+    s.riverDist = distanceToVoronoiEdge(x * 0.02, z * 0.02, 43);
+    s.threshold = 0.f;
+
+    if (s.typeTerrain <= 139) {
+        s.biome = Biome::LOWLAND;
+        return s;
+    }
+
+    // split into three biomes, 0 to 1
+    float terrainPercent = (s.typeTerrain - 139) / 30;
+    if (terrainPercent < 0.333f) {
+        s.biome = Biome::DESERT;
+        float amp = (0.333f / 2.0f) - std::abs(terrainPercent - (0.333f * 0.5));
+        s.threshold = (80 * amp * terrain_perlin) + 139;
+    } else if (terrainPercent < 0.666f) {
+        s.biome = Biome::GRASSLAND;
+        float amp = (0.333f / 2.0f) - std::abs(terrainPercent - (0.333f * 1.5));
+        s.threshold = (80 * amp * terrain_perlin) + 139;
+    } else {
+        s.biome = Biome::MOUNTAINS;
+        float amp = (0.333f / 2.0f) - std::abs(terrainPercent - (0.333f * 2.5));
+        s.threshold = 360 * amp * terrain_perlin + 139;
+    }
+    return s;
+}
+
+Chunk* ChunkNeighborhood::chunkAt(int x, int z) const {
+    int i = static_cast<int>(glm::floor((x - corner.x) / 16.f)) + 1;
+    int j = static_cast<int>(glm::floor((z - corner.y) / 16.f)) + 1;
+    if (i < 0 || i > 2 || j < 0 || j > 2) {
+        return nullptr;
+    }
+    return chunks[i + 3 * j];
+}
+
+bool Terrain::gatherNeighborhood(int x, int z, GenStage minStage, ChunkNeighborhood &out) {
+    out.corner = glm::ivec2(x, z);
+    for (int j = -1; j <= 1; j++) {
+        for (int i = -1; i <= 1; i++) {
+            auto it = m_chunks.find(toKey(x + 16 * i, z + 16 * j));
+            if (it == m_chunks.end() || it->second->stage.load() < minStage) {
+                return false;
+            }
+            out.chunks[(i + 1) + 3 * (j + 1)] = it->second.get();
+        }
+    }
+    return true;
+}
+
+// Bedrock floor and the solid stone core everything else is carved from
+void Terrain::generateBase(Chunk *c) {
+    for (int x = 0; x < 16; x++) {
+        for (int z = 0; z < 16; z++) {
+            c->setLocalBlockAt(x, 0, z, BEDROCK);
+            for (int y = 1; y <= 129; y++) {
+                c->setLocalBlockAt(x, y, z, STONE);
+            }
+        }
+    }
+}
+
+// Biome materials above the stone core, plus the river beds cut by the voronoi edges
+void Terrain::generateSurface(Chunk *c) {
+    glm::ivec2 corner = c->getCorner();
+    for (int lx = 0; lx < 16; lx++) {
+        for (int lz = 0; lz < 16; lz++) {
+            const ColumnSample col = sampleColumn(corner.x + lx, corner.y + lz);
+            const bool river = col.riverDist <= 0.1;
+
+            for (int y = 130; y < 256; y++) {
+                switch (col.biome) {
+                case Biome::LOWLAND:
+                    if (y <= col.typeTerrain) {
+                        c->setLocalBlockAt(lx, y, lz, DIRT);
+                    } else if (y <= 139) {
+                        c->setLocalBlockAt(lx, y, lz, WATER);
+                    }
+                    break;
+                case Biome::DESERT:
+                    if (y <= col.threshold) {
+                        if (!river) {
+                            c->setLocalBlockAt(lx, y, lz, SAND);
+                        } else {
+                            c->setLocalBlockAt(lx, y - 1, lz, WATER);
+                            c->setLocalBlockAt(lx, y, lz, EMPTY);
+                        }
+                    }
+                    break;
+                case Biome::GRASSLAND:
+                case Biome::MOUNTAINS:
+                    if (y <= col.threshold) {
+                        bool top = y + 1 > col.threshold;
+                        if (!top) {
+                            c->setLocalBlockAt(lx, y, lz, col.biome == Biome::GRASSLAND ? DIRT : ICE);
+                        } else if (river) {
+                            c->setLocalBlockAt(lx, y - 1, lz, WATER);
+                            c->setLocalBlockAt(lx, y, lz, EMPTY);
+                        } else {
+                            c->setLocalBlockAt(lx, y, lz, col.biome == Biome::GRASSLAND ? GRASS : SNOW);
+                        }
+                    }
+                    break;
+                }
+            }
+        }
+    }
+}
+
+// Perlin caves through the stone core, flooded with lava near the bottom
+void Terrain::generateCaves(Chunk *c) {
+    glm::ivec2 corner = c->getCorner();
+    for (int lx = 0; lx < 16; lx++) {
+        for (int lz = 0; lz < 16; lz++) {
+            int x = corner.x + lx;
+            int z = corner.y + lz;
+            for (int y = 1; y <= 128; y++) {
+                float noise = PerlinNoise(0.1*x, 0.1*z, 0.1*y);
+                // I know instructions say negative but I find this produces a nice looking result
+                if (noise < 0.5) {
+                    c->setLocalBlockAt(lx, y, lz, y < 25 ? LAVA : EMPTY);
+                }
+            }
+        }
+    }
+}
 
-    if(m_generatedTerrain.count(toKey(xPos, zPos)) > 0) {
+static void placeDecoration(const ChunkNeighborhood &hood, int x, int y, int z, BlockType t) {
+    if (y < 0 || y >= 256) {
         return;
     }
-    if(m_generatedTerrain.find(toKey(xPos, zPos)) != m_generatedTerrain.end()) {
+    Chunk *c = hood.chunkAt(x, z);
+    if (c == nullptr) {
         return;
     }
-    m_generatedTerrain.insert(toKey(xPos, zPos));
+    glm::ivec2 corner = c->getCorner();
+    c->placeDecorationAt(x - corner.x, y, z - corner.y, t);
+}
 
-    int WinChunks = 4;
+static void placeTree(const ChunkNeighborhood &hood, int x, int y, int z) {
+    for (int i = 1; i <= 6; i++) {
+        placeDecoration(hood, x, y + i, z, WOOD);
+    }
+    placeDecoration(hood, x, y + 7, z, LEAVES);
 
-    for(int x = xPos; x < 16*WinChunks + xPos; x += 16) {
-        for(int z = zPos; z < 16*WinChunks + zPos; z += 16) {
-            if(hasChunkAt(x, z)) {
-                auto *c = getChunkAt(x, z).get();
-                c->ready = false;
+    for(int i = -2; i <= 2; i++) {
+        for(int j = -2; j <= 2; j++) {
+            if (i == 0  && j == 0) {
+                continue;
+            }
+            placeDecoration(hood, x + i, y + 4, z + j, LEAVES);
+        }
+    }
+
+    for(int i = -1; i <= 1; i++) {
+        for(int j = -1; j <= 1; j++) {
+            if (i == 0  && j == 0) {
+                continue;
             }
+            placeDecoration(hood, x + i, y + 6, z + j, LEAVES);
         }
     }
+}
+
+// Where trees and cacti may go. Each site is then kept or dropped by the
+// biome of its column.
+static const PlacementGrid treeSites(7, 1, 0.4f, 0x51a7e5u);
+static const PlacementGrid cactusSites(10, 1, 1.f, 0xcac705u);
+
+// How far a decoration reaches past its site: the leaves around a trunk
+static constexpr int DECORATION_REACH = 2;
+
+// Trees and cacti. These may hang over into the neighbouring Chunks, which is
+// why the scheduler waits until all of them have been carved.
+void Terrain::generateDecorations(const ChunkNeighborhood &hood) {
+    const int minX = hood.corner.x;
+    const int minZ = hood.corner.y;
+    // An edited neighbour stayed loaded while an earlier copy of this
+    // Chunk was decorated, so it has these trees already. Placing them
+    // again would put back leaves and wood the player took away.
+    ChunkNeighborhood placed = hood;
+    for (int k = 0; k < 9; k++) {
+        if (k != 4 && placed.chunks[k]->edited) {
+            placed.chunks[k] = nullptr;
+        }
+    }
+    placeDecorations(placed, minX, minZ, minX + 16, minZ + 16);
+
+    // A neighbour decorated before this Chunk was last generated hung its
+    // trees over into a copy of it that has since been unloaded. Put them
+    // back, into this Chunk only; placing a decoration twice is harmless.
+    ChunkNeighborhood own = hood;
+    own.chunks.fill(nullptr);
+    own.chunks[4] = hood.center();
+    for (int k = 0; k < 9; k++) {
+        if (k == 4 || hood.chunks[k]->stage < GenStage::DECORATIONS) {
+            continue;
+        }
+        glm::ivec2 corner = hood.chunks[k]->getCorner();
+        placeDecorations(own, std::max(corner.x, minX - DECORATION_REACH), std::max(corner.y, minZ - DECORATION_REACH),
+                         std::min(corner.x + 16, minX + 16 + DECORATION_REACH), std::min(corner.y + 16, minZ + 16 + DECORATION_REACH));
+    }
+}
 
-    std::cout << "Generating Terrain at " << xPos << ", " << zPos << std::endl;
+void Terrain::placeDecorations(const ChunkNeighborhood &hood, int minX, int minZ, int maxX, int maxZ) {
+    std::vector<PlacementSite> sites;
+    cactusSites.sitesIn(minX, minZ, maxX, maxZ, sites);
+    const size_t cactusCount = sites.size();
+    treeSites.sitesIn(minX, minZ, maxX, maxZ, sites);
+
+    for (size_t i = 0; i < sites.size(); i++) {
+        const PlacementSite &site = sites[i];
+        const bool cactus = i < cactusCount;
+
+        const ColumnSample col = sampleColumn(site.x, site.z);
+        if (col.biome == Biome::LOWLAND || col.riverDist <= 0.1) {
+            continue;
+        }
+        if (cactus != (col.biome == Biome::DESERT)) {
+            continue;
+        }
+        // The surface block is the highest y with y <= threshold < y + 1
+        int y = static_cast<int>(glm::floor(col.threshold));
+        if (y < 130 || y > 255) {
+            continue;
+        }
+
+        if (cactus) {
+            int height = 3 + site.variant % 2;
+            for (int h = 1; h <= height; h++) {
+                placeDecoration(hood, site.x, y + h, site.z, CACTUS);
+            }
+        } else {
+            placeTree(hood, site.x, y, site.z);
+        }
+    }
+}
+
+// Runs one stage and charges its time to stats
+template <typename F>
+static void timeStage(GenerationStats &stats, GenStage s, F &&stage) {
+    auto start = std::chrono::steady_clock::now();
+    stage();
+    auto end = std::chrono::steady_clock::now();
+    stats.nanos[static_cast<int>(s)] += std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+    stats.chunks[static_cast<int>(s)]++;
+}
+
+bool Terrain::requestZone(int x, int z) {
+    zoneMutex.lock();
+    auto found = m_zones.find(toKey(x, z));
+    bool queue = false;
+    if (found != m_zones.end() && found->second != ZoneState::CANCELLED) {
+        if (found->second == ZoneState::IN_PROGRESS) {
+            m_zoneStats.duplicates++;
+        }
+    } else if (m_zoneStats.inFlight >= m_maxZonesInFlight) {
+        if (m_deferredZones.insert(toKey(x, z)).second) {
+            m_zoneStats.deferred++;
+        }
+    } else {
+        m_deferredZones.erase(toKey(x, z));
+        m_zones[toKey(x, z)] = ZoneState::REQUESTED;
+        m_zoneStats.requested++;
+        m_zoneStats.peakInFlight = std::max(m_zoneStats.peakInFlight.load(), ++m_zoneStats.inFlight);
+        queue = true;
+    }
+    zoneMutex.unlock();
+    return queue;
+}
+
+void Terrain::finishZone(int x, int z, bool done) {
+    zoneMutex.lock();
+    // A cancelled zone keeps its entry, so the Chunks it left behind are
+    // unloaded along with it. It's requested again if it's still in view.
+    m_zones[toKey(x, z)] = done ? ZoneState::DONE : ZoneState::CANCELLED;
+    m_zoneStats.inFlight--;
+    zoneMutex.unlock();
+}
+
+void Terrain::setMaxZonesInFlight(int zones) {
+    m_maxZonesInFlight = std::max(1, zones);
+}
+
+const ZoneStats& Terrain::zoneStats() const {
+    return m_zoneStats;
+}
+
+bool Terrain::GenerateTerrain(int xPos, int zPos, const CancelToken &cancelled)  {
+
+    // Zones requested through requestZone() are already counted in
+    // flight; ones generated directly start counting here
+    zoneMutex.lock();
+    auto found = m_zones.find(toKey(xPos, zPos));
+    if (found == m_zones.end() || found->second == ZoneState::CANCELLED) {
+        m_zones[toKey(xPos, zPos)] = ZoneState::IN_PROGRESS;
+        m_zoneStats.peakInFlight = std::max(m_zoneStats.peakInFlight.load(), ++m_zoneStats.inFlight);
+    } else if (found->second == ZoneState::REQUESTED) {
+        found->second = ZoneState::IN_PROGRESS;
+    } else {
+        if (found->second == ZoneState::IN_PROGRESS) {
+            m_zoneStats.duplicates++;
+        }
+        zoneMutex.unlock();
+        return true;
+    }
+    zoneMutex.unlock();
+
+    // Don't allocate Chunks for a zone that's no longer wanted
+    if (cancelled && cancelled()) {
+        finishZone(xPos, zPos, false);
+        m_genStats.cancelled++;
+        return false;
+    }
+
+    int WinChunks = 4;
 
     // Create the Chunks that will
     // store the blocks for our
-    // initial world space
+    // initial world space. A zone that was cancelled part way
+    // through already has them.
+    std::vector<Chunk*> zone;
     for(int x = xPos; x < 16*WinChunks + xPos; x += 16) {
         for(int z = zPos; z < 16*WinChunks + zPos; z += 16) {
-            instantiateChunkAt(x, z);
+            chunkMutex.lock();
+            Chunk *c = hasChunkAt(x, z) ? getChunkAt(x, z).get() : nullptr;
+            chunkMutex.unlock();
+            if (c == nullptr) {
+                c = instantiateChunkAt(x, z);
+                c->transition(ChunkState::ALLOCATED, ChunkState::GENERATING);
+            }
+            c->staging = true;
+            zone.push_back(c);
         }
     }
 
-    // Create the basic terrain floor
-    for (int x = xPos; x < 16*WinChunks + xPos; x++) {
-        for (int z = zPos; z < 16*WinChunks + zPos; z++) {
+    if (mp_store != nullptr && mp_store->loadZone(xPos, zPos, zone)) {
+        // Stored zones are complete, decorations included. They still go
+        // through the decoration stage so their trees reach any neighbours
+        // generated fresh; placing the same decoration twice is harmless.
+        for (Chunk *c : zone) {
+            c->stage = GenStage::CAVES;
+            c->staging = false;
+            m_changedChunks.push(c);
+        }
+        finishZone(xPos, zPos, true);
+        m_zoneStats.loaded++;
+        return true;
+    }
 
-            const float typeTerrain = 40 * PerlinNoise(x * 0.003, 12, z * 0.003) + 129;
-            const float terrain_perlin = PerlinNoise(x * 0.02, 12.23, z * 0.02);
-            const float dist = distanceToVoronoiEdge(x * 0.02, z * 0.02, 43);
+    // The column-local stages never look past their own Chunk, so the only
+    // neighbours they wait on are the ones in this zone. Running each stage
+    // over the whole zone before starting the next keeps that ordering.
+    auto runStage = [&](GenStage s, void (Terrain::*generate)(Chunk*)) {
+        if (cancelled && cancelled()) {
+            return false;
+        }
+        for (Chunk *c : zone) {
+            if (c->stage < s) {
+                timeStage(m_genStats, s, [&]() { (this->*generate)(c); });
+                c->stage = s;
+            }
+        }
+        return true;
+    };
+    bool done = runStage(GenStage::BASE, &Terrain::generateBase)
+                && runStage(GenStage::SURFACE, &Terrain::generateSurface)
+                && runStage(GenStage::CAVES, &Terrain::generateCaves);
+
+    for (Chunk *c : zone) {
+        c->staging = false;
+        if (done) {
+            m_changedChunks.push(c);
+        }
+    }
+    finishZone(xPos, zPos, done);
+    if (!done) {
+        m_genStats.cancelled++;
+        return false;
+    }
+    return true;
+}
 
-            for(int y = 0; y < 256; y++) {
-                if (y == 0) {
-                    setGlobalBlockAt(x, y, z, BEDROCK);
-                } else if (y <= 128) {
-                    float noise = PerlinNoise(0.1*x, 0.1*z, 0.1*y);
-                    // I know instructions say negative but I find this produces a nice looking result
-                    if (noise < 0.5) {
-                        if (y<25) {
-                            setGlobalBlockAt(x, y, z, LAVA);
-                        } else {
-                            setGlobalBlockAt(x, y, z, EMPTY);
-                        }
-                    } else {
-                        setGlobalBlockAt(x, y, z, STONE);
-                    }
-                } else if (y == 129) {
-                    setGlobalBlockAt(x, y, z, STONE);
+// Holds every Chunk of hood for the length of a job (delta 1), or lets
+// them go again (delta -1), so none is unloaded from under it
+static void pinNeighborhood(const ChunkNeighborhood &hood, int delta) {
+    for (Chunk *c : hood.chunks) {
+        c->pins += delta;
+    }
+}
+
+void Terrain::scheduleChunkStages() {
+    // Work only becomes possible for a Chunk when it or a neighbour
+    // changes, so those are the only ones looked at
+    std::vector<Chunk*> changed;
+    m_changedChunks.drain(changed);
+    std::unordered_set<Chunk*> candidates;
+    if (m_interestMoved.exchange(false)) {
+        candidates.swap(m_parkedChunks);
+    }
+
+    chunkMutex.lock();
+    for (Chunk *changedChunk : changed) {
+        glm::ivec2 corner = changedChunk->getCorner();
+        for (int dx = -16; dx <= 16; dx += 16) {
+            for (int dz = -16; dz <= 16; dz += 16) {
+                if (hasChunkAt(corner.x + dx, corner.y + dz)) {
+                    candidates.insert(getChunkAt(corner.x + dx, corner.y + dz).get());
                 }
-                else {
-                        if (typeTerrain <= 139) {
-                            if (y <= typeTerrain) {
-                                setGlobalBlockAt(x, y, z, DIRT);
-                            }
-                            else if (y > typeTerrain && y <= 139) {
-                                setGlobalBlockAt(x, y, z, WATER);
-                            }
-                        } else {
-                            // split into four biomes:
-                            float terrainPercent = (typeTerrain - 139) / 30;
-                            // 0 to 1
-                            if (terrainPercent < 0.333f) {
-                                // std::cout << "A" << x << ", " << z << std::endl;
-
-                                float temp = (terrainPercent - (0.333f * 0.5));
-                                if (temp < 0) {
-                                    temp = -temp;
-                                }
-
-                                float amp = (0.333f / 2.0f) - temp;
-
-                                float threshold = (80 * amp * terrain_perlin) + 139;
-
-                                if (y <= threshold) {
-                                    if (dist > 0.1) {
-                                        setGlobalBlockAt(x, y, z, SAND);
-                                        if(y+1 > threshold) {
-                                            if (x % 10 == (int)(threshold) % 10 && z % 10 == (int)(threshold) % 10) {
-                                                setGlobalBlockAt(x, y+1, z, CACTUS);
-                                                setGlobalBlockAt(x, y+2, z, CACTUS);
-                                                setGlobalBlockAt(x, y+3, z, CACTUS);
-                                                if (x % 10 > 4) {
-                                                    setGlobalBlockAt(x, y+4, z, CACTUS);
-                                                }
-                                            }
-                                        }
-                                    } else {
-                                        setGlobalBlockAt(x, y-1, z, WATER);
-                                        setGlobalBlockAt(x, y, z, EMPTY);
-                                    }
-                                }
-                            } else if (terrainPercent < 0.666f) {
-                                //     //Grass
-                                // std::cout << "B " << x << ", " << z << std::endl;
-                                float temp = (terrainPercent - (0.333f * 1.5));
-                                if (temp < 0) {
-                                    temp = -temp;
-                                }
-
-                                float amp = (0.333f / 2.0f) - temp;
-
-                                float threshold = (80 * amp * terrain_perlin) + 139;
-
-                                if (y <= threshold) {
-                                    if(y + 1 > threshold) {
-                                        if(dist > 0.1) {
-                                            setGlobalBlockAt(x, y, z, GRASS);
-                                            if (noise(x, z) > 0.97f) {
-
-                                                bool ctd = true;
-                                                for(int i = -3; i <= 3; i++) {
-                                                    for(int j = -3; j <= 3; j++) {
-                                                        if ((x + i) % 16 == 0 || (z + j) % 16 == 0 || noise(x+i, z+j) > 0.99f) {
-                                                            ctd = false;
-                                                        }
-                                                    }
-                                                }
-
-                                                if(ctd) {
-                                                    setGlobalBlockAt(x, y+1, z, WOOD);
-                                                    setGlobalBlockAt(x, y+2, z, WOOD);
-                                                    setGlobalBlockAt(x, y+3, z, WOOD);
-                                                    setGlobalBlockAt(x, y+4, z, WOOD);
-                                                    setGlobalBlockAt(x, y+5, z, WOOD);
-                                                    setGlobalBlockAt(x, y+6, z, WOOD);
-                                                    setGlobalBlockAt(x, y+7, z, LEAVES);
-
-                                                    for(int i = -2; i <= 2; i++) {
-                                                        for(int j = -2; j <= 2; j++) {
-                                                            if (i == 0  && j == 0) {
-                                                                continue;
-                                                            }
-
-                                                            setGlobalBlockAt(x+i, y+4, z+j, LEAVES);
-                                                        }
-                                                    }
-
-                                                    for(int i = -1; i <= 1; i++) {
-                                                        for(int j = -1; j <= 1; j++) {
-                                                            if (i == 0  && j == 0) {
-                                                                continue;
-                                                            }
-
-                                                            setGlobalBlockAt(x+i, y+6, z+j, LEAVES);
-                                                        }
-                                                    }
-                                                }
-                                            }
-                                        } else {
-                                            setGlobalBlockAt(x, y-1, z, WATER);
-                                            setGlobalBlockAt(x, y, z, EMPTY);
-                                        }
-                                    } else {
-                                        setGlobalBlockAt(x, y, z, DIRT);
-                                    }
-                                }
-                            } else {
-                                //     //Snowy Mountains
-
-                                float temp = terrainPercent - (0.333f * 2.5);
-                                if (temp < 0) {
-                                    temp = -temp;
-                                }
-                                float amp = (0.333f / 2.0f) - temp;
-
-
-                                float threshold = 360 * amp * terrain_perlin + 139;
-
-                                if (y <= threshold) {
-                                    if(y + 1 > threshold) {
-                                        setGlobalBlockAt(x, y, z, SNOW);
-
-                                        if (dist > 0.1) {
-                                            if (noise(x, z) > 0.97f) {
-                                                bool ctd = true;
-                                                for(int i = -3; i <= 3; i++) {
-                                                    for(int j = -3; j <= 3; j++) {
-                                                        if ((x + i) % 16 == 0 || (z + j) % 16 == 0 || noise(x+i, z+j) > 0.99f) {
-                                                            ctd = false;
-                                                        }
-                                                    }
-                                                }
-
-                                                if(!ctd) {
-                                                    break;
-                                                }
-
-                                                if(ctd) {
-                                                    setGlobalBlockAt(x, y+1, z, WOOD);
-                                                    setGlobalBlockAt(x, y+2, z, WOOD);
-                                                    setGlobalBlockAt(x, y+3, z, WOOD);
-                                                    setGlobalBlockAt(x, y+4, z, WOOD);
-                                                    setGlobalBlockAt(x, y+5, z, WOOD);
-                                                    setGlobalBlockAt(x, y+6, z, WOOD);
-                                                    setGlobalBlockAt(x, y+7, z, LEAVES);
-
-                                                    for(int i = -2; i <= 2; i++) {
-                                                        for(int j = -2; j <= 2; j++) {
-                                                            if (i == 0  && j == 0) {
-                                                                continue;
-                                                            }
-
-                                                            setGlobalBlockAt(x+i, y+4, z+j, LEAVES);
-                                                        }
-                                                    }
-
-                                                    for(int i = -1; i <= 1; i++) {
-                                                        for(int j = -1; j <= 1; j++) {
-                                                            if (i == 0  && j == 0) {
-                                                                continue;
-                                                            }
-
-                                                            setGlobalBlockAt(x+i, y+6, z+j, LEAVES);
-                                                        }
-                                                    }
-                                                }
-                                            }
-                                        } else {
-                                            setGlobalBlockAt(x, y-1, z, WATER);
-                                            setGlobalBlockAt(x, y, z, EMPTY);
-                                        }
-                                    } else {
-                                        setGlobalBlockAt(x, y, z, ICE);
-                                    }
-                                }
-                            }
-                        }
+            }
+        }
+    }
+
+    for (Chunk *c : candidates) {
+        glm::ivec2 corner = c->getCorner();
+        const glm::vec2 center = glm::vec2(corner) + 8.f;
+        if (!isOfInterest(center)) {
+            // Looked at again once the area of interest moves
+            m_parkedChunks.insert(c);
+            continue;
+        }
+        ChunkNeighborhood hood;
+
+        // Every job below hands its Chunk back through m_changedChunks or
+        // m_meshedChunks when it lets go of it, whatever the outcome
+        ChunkState state = c->getState();
+        if (state == ChunkState::GENERATING) {
+            if (!c->staging && c->stage == GenStage::CAVES && gatherNeighborhood(corner.x, corner.y, GenStage::CAVES, hood)) {
+                c->staging = true;
+                pinNeighborhood(hood, 1);
+                m_launchJob(center, [this, hood, center]() {
+                    Chunk *c = hood.center();
+                    if (!isOfInterest(center)) {
+                        m_genStats.cancelled++;
+                        c->staging = false;
+                        m_changedChunks.push(c);
+                        pinNeighborhood(hood, -1);
+                        return;
                     }
+                    timeStage(m_genStats, GenStage::DECORATIONS, [&]() { generateDecorations(hood); });
+                    c->stage = GenStage::DECORATIONS;
+                    c->staging = false;
+                    c->transition(ChunkState::GENERATING, ChunkState::GENERATED);
+                    m_changedChunks.push(c);
+                    pinNeighborhood(hood, -1);
+                });
+            }
+        } else if ((state == ChunkState::GENERATED || state == ChunkState::DIRTY) && m_meshingEnabled && !c->staging
+                   && gatherNeighborhood(corner.x, corner.y, GenStage::DECORATIONS, hood)
+                   && c->transition(state, ChunkState::MESHING)) {
+            // Every block this Chunk will ever get from generation is in
+            // place, so its faces can be built
+            c->staging = true;
+            // Meshing reads the neighbours' border blocks
+            pinNeighborhood(hood, 1);
+            // Someone is waiting on an edit; spread it over the workers
+            bool split = state == ChunkState::DIRTY;
+            m_launchJob(center, [this, c, hood, center, split]() {
+                if (!isOfInterest(center)) {
+                    // Left for whenever the player comes back
+                    m_genStats.cancelled++;
+                    c->transition(ChunkState::MESHING, ChunkState::DIRTY);
+                    c->staging = false;
+                    m_changedChunks.push(c);
+                    pinNeighborhood(hood, -1);
+                    return;
+                }
+                timeStage(m_genStats, GenStage::MESH, [&]() { c->generateVBOData(split ? m_parallelFor : ParallelFor()); });
+                // Fails if a block changed meanwhile; the Chunk then stays
+                // DIRTY and is meshed again once this job lets go of it
+                bool meshed = c->transition(ChunkState::MESHING, ChunkState::MESHED);
+                c->staging = false;
+                if (meshed) {
+                    m_meshedChunks.push(c);
+                } else {
+                    m_changedChunks.push(c);
+                }
+                pinNeighborhood(hood, -1);
+            });
+        }
+    }
+    chunkMutex.unlock();
+}
+
+int Terrain::unloadZonesOutside(glm::vec2 center, float halfSize) {
+    std::vector<glm::ivec2> zones;
+    auto outside = [&](glm::ivec2 corner) {
+        return corner.x + 64 <= center.x - halfSize || corner.x >= center.x + halfSize
+               || corner.y + 64 <= center.y - halfSize || corner.y >= center.y + halfSize;
+    };
+    zoneMutex.lock();
+    // One that's left the area without being queued counts as deferred
+    // afresh if the player brings it back
+    for (auto it = m_deferredZones.begin(); it != m_deferredZones.end();) {
+        it = outside(toCoords(*it)) ? m_deferredZones.erase(it) : std::next(it);
+    }
+    for (auto &zone : m_zones) {
+        glm::ivec2 corner = toCoords(zone.first);
+        if ((zone.second == ZoneState::DONE || zone.second == ZoneState::CANCELLED) && outside(corner)) {
+            zones.push_back(corner);
+        }
+    }
+    zoneMutex.unlock();
+    if (zones.empty()) {
+        return 0;
+    }
+
+    // No job can pin a Chunk meanwhile, as only scheduleChunkStages()
+    // starts them. One that's just let go has already pushed its Chunk.
+    // Nor can a cancelled zone start again, as only requestZone() on this
+    // same thread queues it.
+    std::vector<glm::ivec2> unloaded;
+    std::unordered_set<Chunk*> gone;
+    chunkMutex.lock();
+    for (glm::ivec2 zone : zones) {
+        bool keep = false;
+        for (int x = zone.x; x < zone.x + 64 && !keep; x += 16) {
+            for (int z = zone.y; z < zone.y + 64 && !keep; z += 16) {
+                auto it = m_chunks.find(toKey(x, z));
+                keep = it != m_chunks.end() && (it->second->pins > 0 || it->second->edited);
+            }
+        }
+        if (keep) {
+            continue;
+        }
+        for (int x = zone.x; x < zone.x + 64; x += 16) {
+            for (int z = zone.y; z < zone.y + 64; z += 16) {
+                auto it = m_chunks.find(toKey(x, z));
+                if (it == m_chunks.end()) {
+                    continue;
                 }
+                it->second->unlinkNeighbors();
+                gone.insert(it->second.get());
+                m_unloadedChunks.push(it->second.release());
+                m_chunks.erase(it);
             }
         }
+        unloaded.push_back(zone);
+    }
+    chunkMutex.unlock();
+
+    zoneMutex.lock();
+    for (glm::ivec2 zone : unloaded) {
+        // Requested again, and generated afresh, if the player comes back
+        m_zones.erase(toKey(zone.x, zone.y));
+    }
+    zoneMutex.unlock();
+
+    // Forget every other reference this thread has to them
+    std::vector<Chunk*> changed;
+    m_changedChunks.drain(changed);
+    for (Chunk *c : changed) {
+        if (gone.count(c) == 0) {
+            m_changedChunks.push(c);
+        }
+    }
+    for (Chunk *c : gone) {
+        m_parkedChunks.erase(c);
+    }
+    return static_cast<int>(unloaded.size());
+}
 
+size_t Terrain::loadedChunks() {
+    chunkMutex.lock();
+    size_t count = m_chunks.size();
+    chunkMutex.unlock();
+    return count;
+}
 
+void Terrain::setJobLauncher(JobLauncher launcher) {
+    m_launchJob = std::move(launcher);
+}
 
-    // std::cout << "Part 2 for at " << xPos << ", " << zPos << std::endl;
+void Terrain::setParallelFor(ParallelFor parallelFor) {
+    m_parallelFor = std::move(parallelFor);
+}
 
+void Terrain::setInterest(glm::vec2 center, float halfSize) {
+    interestMutex.lock();
+    if (center != m_interestCenter || halfSize != m_interestHalfSize) {
+        m_interestMoved = true;
+    }
+    m_interestCenter = center;
+    m_interestHalfSize = halfSize;
+    interestMutex.unlock();
+}
 
+bool Terrain::isOfInterest(glm::vec2 p) const {
+    interestMutex.lock();
+    glm::vec2 offset = glm::abs(p - m_interestCenter);
+    bool inside = offset.x <= m_interestHalfSize && offset.y <= m_interestHalfSize;
+    interestMutex.unlock();
+    return inside;
+}
 
-    // for(int y = 0; y < 255; y++) {
-    //     for (int x = xPos; x < 16*WinChunks + xPos; x++) {
-    //         for (int z = zPos; z < 16*WinChunks + zPos; z++) {
-    //             if (y <= 8 * PerlinNoise(x / 20.37, 100, z /20.37) + 60) {
-    //                 setGlobalBlockAt(x, y, z, STONE);
-    //             }
-    //         }
-    //     }
-    // }
+const GenerationStats& Terrain::generationStats() const {
+    return m_genStats;
+}
 
-    // std::cout << "Part 3 for at " << xPos << ", " << zPos << std::endl;
+void Terrain::setWorldStore(WorldStore *store) {
+    mp_store = store;
+}
 
-    for(int x = xPos; x < 16*WinChunks + xPos; x += 16) {
-        for(int z = zPos; z < 16*WinChunks + zPos; z += 16) {
-            auto *c = getChunkAt(x, z).get();
-            c->ready = true;
-        }
-    }
+void Terrain::setMeshingEnabled(bool enabled) {
+    m_meshingEnabled = enabled;
+}
 
+bool Terrain::isChunkFinal(int x, int z) {
+    chunkMutex.lock();
+    ChunkNeighborhood hood;
+    bool done = gatherNeighborhood(16 * static_cast<int>(glm::floor(x / 16.f)), 16 * static_cast<int>(glm::floor(z / 16.f)),
+                                    GenStage::DECORATIONS, hood);
+    chunkMutex.unlock();
+    return done;
+}
 
-    std::cout << "Success at " << xPos << ", " << zPos << std::endl;
+ChunkState Terrain::chunkState(int x, int z) {
+    chunkMutex.lock();
+    ChunkState s = hasChunkAt(x, z) ? getChunkAt(x, z)->getState() : ChunkState::ALLOCATED;
+    chunkMutex.unlock();
+    return s;
 }
 
 
@@ -513,14 +1349,26 @@ float PerlinNoise(float x, float y, float z) {
         return (h & 1 ? -u : u) + (h & 2 ? -v : v) + (h & 4 ? -z : z);
     };
 
-    // Permutation table (fixed, deterministic)
-    static const int p[] = {
+    // Permutation table (fixed, deterministic): Ken Perlin's reference
+    // permutation of 0..255. Every lookup below is masked with & 255, so
+    // it has to hold all 256 entries.
+    static const int p[256] = {
         151, 160, 137, 91, 90, 15, 131, 13, 201, 95, 96, 53, 194, 233, 7, 225,
         140, 36, 103, 30, 69, 142, 8, 99, 37, 240, 21, 10, 23, 190, 6, 148,
         247, 120, 234, 75, 0, 26, 197, 62, 94, 252, 219, 203, 117, 35, 11, 32,
         57, 177, 33, 88, 237, 149, 56, 87, 174, 20, 125, 136, 171, 168, 68, 175,
-        74, 165, 71, 134, 139, 48, 27, 166, 77, 146, 158, 231, 83, 109, 32, 41,
-        131, 94, 255, 125, 48, 167, 57, 183, 146, 103, 190, 38, 127, 190, 115, 103
+        74, 165, 71, 134, 139, 48, 27, 166, 77, 146, 158, 231, 83, 111, 229, 122,
+        60, 211, 133, 230, 220, 105, 92, 41, 55, 46, 245, 40, 244, 102, 143, 54,
+        65, 25, 63, 161, 1, 216, 80, 73, 209, 76, 132, 187, 208, 89, 18, 169,
+        200, 196, 135, 130, 116, 188, 159, 86, 164, 100, 109, 198, 173, 186, 3, 64,
+        52, 217, 226, 250, 124, 123, 5, 202, 38, 147, 118, 126, 255, 82, 85, 212,
+        207, 206, 59, 227, 47, 16, 58, 17, 182, 189, 28, 42, 223, 183, 170, 213,
+        119, 248, 152, 2, 44, 154, 163, 70, 221, 153, 101, 155, 167, 43, 172, 9,
+        129, 22, 39, 253, 19, 98, 108, 110, 79, 113, 224, 232, 178, 185, 112, 104,
+        218, 246, 97, 228, 251, 34, 242, 193, 238, 210, 144, 12, 191, 179, 162, 241,
+        81, 51, 145, 235, 249, 14, 239, 107, 49, 192, 214, 31, 181, 199, 106, 157,
+        184, 84, 204, 176, 115, 121, 50, 45, 127, 4, 150, 254, 138, 236, 205, 93,
+        222, 114, 67, 29, 24, 72, 243, 141, 128, 195, 78, 66, 215, 61, 156, 180
     };
 
     // Hash function to map 2D coordinates to a deterministic pseudo-random value
@@ -3,13 +3,139 @@
 #include "chunk.h"
 #include <unordered_map>
 #include <unordered_set>
+#include <functional>
 #include "shaderprogram.h"
+#include "worldstore.h"
+#include "mpscqueue.h"
+#include "gluploader.h"
+#include "chunkrenderer.h"
+#include "frustum.h"
 
 //using namespace std;
 
 // Helper functions to convert (x, z) to and from hash map key
 int64_t toKey(int x, int z);
 glm::ivec2 toCoords(int64_t k);
+// Lower-left corner of the terrain generation zone the player at
+// world-space (x, z) is considered to be standing in
+glm::ivec2 zoneAround(float x, float z);
+
+// The 3 x 3 block of Chunks centred on the one being generated.
+// Decorations and meshing reach one Chunk past their own borders,
+// so those stages are handed the whole neighbourhood up front.
+struct ChunkNeighborhood {
+    std::array<Chunk*, 9> chunks;
+    glm::ivec2 corner; // lower-left corner of the centre Chunk
+
+    Chunk* center() const { return chunks[4]; }
+    // The Chunk containing world-space (x, z), or nullptr if it
+    // lies outside the neighbourhood
+    Chunk* chunkAt(int x, int z) const;
+};
+
+// Hands a unit of generation work to whatever runs it, along with the
+// world-space (x, z) it works on so nearer work can go first. By default
+// every job gets its own detached std::thread.
+using JobLauncher = std::function<void(glm::vec2, std::function<void()>)>;
+
+// Checked by a generation job between stages; returns true once the
+// job's result is no longer wanted.
+using CancelToken = std::function<bool()>;
+
+// CPU time spent in each generation stage, summed over all workers,
+// and how many Chunks went through it. Indexed by GenStage.
+struct GenerationStats {
+    std::array<std::atomic<int64_t>, 6> nanos{};
+    std::array<std::atomic<int64_t>, 6> chunks{};
+    // Jobs that gave up because they fell outside the area of interest
+    std::atomic<int64_t> cancelled{0};
+};
+
+// Where a terrain generation zone is. A zone with no entry has never
+// been asked for, or has been unloaded.
+enum class ZoneState : unsigned char {
+    REQUESTED,   // a job has been queued but hasn't started
+    IN_PROGRESS, // GenerateTerrain() is running for it
+    DONE,
+    CANCELLED    // gave up part way; may be asked for again, or unloaded
+};
+
+// Zone requests, as seen by Terrain::requestZone() and GenerateTerrain()
+struct ZoneStats {
+    std::atomic<int64_t> requested{0};
+    // Requests, or jobs, for a zone already running. Requests for one
+    // still queued aren't counted; the game asks again every step until
+    // it starts.
+    std::atomic<int64_t> duplicates{0};
+    // Zones turned away because too many were in flight. Each counts
+    // once, however many steps it waits before it's queued.
+    std::atomic<int64_t> deferred{0};
+    // Zones read from the world store rather than generated
+    std::atomic<int64_t> loaded{0};
+    std::atomic<int> inFlight{0};
+    // Only raised under Terrain's zoneMutex, which is what makes its
+    // load-then-store a max
+    std::atomic<int> peakInFlight{0};
+};
+
+// What the last Terrain::loadChunkVBOs() call sent to the GPU
+struct UploadStats {
+    int uploads = 0;      // Chunks uploaded
+    size_t bytes = 0;     // vertex and index data uploaded
+    size_t backlog = 0;   // meshed Chunks left for later frames
+    size_t inFlight = 0;  // Chunks on the upload thread, if there is one
+    int released = 0;     // unloaded Chunks whose meshes were freed
+    double millis = 0.0;  // time spent uploading
+};
+
+// What the last Terrain::findVisible() call looked at
+struct CullStats {
+    int groupsTested = 0; // zone-sized blocks of Chunks tested as a whole
+    int chunksTested = 0;
+    int chunksDrawn = 0;
+    // Sections with faces, in Chunks inside the frustum, that cave
+    // culling found the camera can't see
+    int sectionsHidden = 0;
+    // Opaque faces in the sections the camera draws, and those of them
+    // skipped for facing directions that can't face it
+    int opaqueFaces = 0;
+    int facesSkipped = 0;
+    int castersTested = 0; // Chunks tested against shadow caster volumes
+    // Chunks found to cast into each shadow cascade asked about
+    std::array<int, SHADOW_CASCADES> castersFound{};
+};
+
+// The passes a frame draws Chunks in, as bits of VisibleChunk::passes.
+// Shadow cascade i is drawn in shadowPass(i).
+enum RenderPass : uint8_t {
+    PASS_CAMERA = 1, PASS_SHADOW = 2
+};
+inline RenderPass shadowPass(int cascade) {
+    return static_cast<RenderPass>(PASS_SHADOW << cascade);
+}
+
+// A shadow cascade to find the Chunks to draw into
+struct ShadowView {
+    int cascade;
+    glm::mat4 casterViewProj; // Everything that can cast into it, see ShadowCascades
+};
+
+// The camera, and the shadow cascades, Terrain::findVisible() culls against
+struct CullView {
+    Frustum frustum;
+    glm::vec3 eye;
+    bool caves; // Also skip sections the camera can't see into through caves
+    std::vector<ShadowView> shadows;
+};
+
+// A Chunk worth drawing this frame, and which passes want it
+struct VisibleChunk {
+    Chunk *chunk;
+    uint8_t passes;
+    uint16_t sections; // Sections the camera pass draws, one bit each
+    uint8_t directions; // Directions of opaque faces it draws, one bit each
+};
+using VisibleSet = std::vector<VisibleChunk>;
 
 // The container class for all of the Chunks in the game.
 // Ultimately, while Terrain will always store all Chunks,
@@ -34,10 +160,16 @@ private:
     // one 64 x 64 area with its lower-left corner at (0, 0).
     // When milestone 1 has been implemented, the Player can move around the
     // world to add more "terrain generation zone" IDs to this set.
-    // While only the 3 x 3 collection of terrain generation zones
-    // surrounding the Player should be rendered, the Chunks
-    // in the Terrain will never be deleted until the program is terminated.
-    std::unordered_set<int64_t> m_generatedTerrain;
+    // Zones that fall far enough behind the player are unloaded again by
+    // unloadZonesOutside(), unless one of their Chunks was edited.
+    // Zones are tracked from the moment they're requested, so one that's
+    // queued but not yet started isn't queued a second time.
+    std::unordered_map<int64_t, ZoneState> m_zones;
+    // Zones turned away by requestZone() and not queued since
+    std::unordered_set<int64_t> m_deferredZones;
+    std::mutex zoneMutex; // Guards m_zones and m_deferredZones
+    ZoneStats m_zoneStats;
+    int m_maxZonesInFlight;
 
     // TODO: DELETE ALL REFERENCES TO m_geomCube AS YOU WILL NOT USE
     // IT IN YOUR FINAL PROGRAM!
@@ -51,6 +183,74 @@ private:
 
     OpenGLContext* mp_context;
 
+    JobLauncher m_launchJob;
+    // Splits one edited Chunk's remesh across threads. Unset, it's serial.
+    ParallelFor m_parallelFor;
+    GenerationStats m_genStats;
+    // Zones found here are loaded instead of generated. Not owned.
+    WorldStore *mp_store;
+    bool m_meshingEnabled;
+    // How much loadChunkVBOs() may upload per call
+    size_t m_uploadByteBudget;
+    double m_uploadTimeBudgetMs;
+    UploadStats m_uploadStats;
+    // Does the uploads off the main thread if set. Not owned.
+    GLUploader *mp_uploader;
+    // Holds every uploaded mesh and draws them if set. Not owned.
+    ChunkRenderer *mp_renderer;
+    CullStats m_cullStats;
+    // Culling tests CULL_GROUP_SIZE square blocks of Chunks before the
+    // Chunks in them once draw() covers at least CULL_GROUP_MIN_SPAN
+    static constexpr int CULL_GROUP_SIZE = 64;
+    static constexpr int CULL_GROUP_MIN_SPAN = 256;
+    // Chunks centred outside this square get no new work, and jobs
+    // already queued for them give up between stages. Guarded by
+    // interestMutex, so no one sees a new centre with an old size.
+    glm::vec2 m_interestCenter;
+    float m_interestHalfSize;
+    mutable std::mutex interestMutex;
+    std::atomic<bool> m_interestMoved;
+
+    // Chunks whose stage or state just changed, so that they or their
+    // neighbours may be ready for the next stage. Drained by
+    // scheduleChunkStages().
+    MPSCQueue<Chunk*> m_changedChunks;
+    // Chunks just MESHED, drained by loadChunkVBOs()
+    MPSCQueue<Chunk*> m_meshedChunks;
+    // Changed Chunks outside the area of interest, seen again when it moves.
+    // Only touched by scheduleChunkStages().
+    std::unordered_set<Chunk*> m_parkedChunks;
+    // Meshed Chunks the upload budget held back. Only touched by loadChunkVBOs().
+    std::vector<Chunk*> m_uploadBacklog;
+    // Corners of Chunks whose meshes changed on the GPU since the last
+    // takeMeshChanges(). Only touched on the main thread.
+    std::vector<glm::ivec2> m_meshChanges;
+    // Chunks unloadZonesOutside() took out of m_chunks, handed to the
+    // main thread to free their meshes and delete
+    MPSCQueue<Chunk*> m_unloadedChunks;
+    // Those waiting on the upload thread to let go of them. Only touched
+    // by loadChunkVBOs().
+    std::vector<uPtr<Chunk>> m_retiringChunks;
+
+    // Fills out with the Chunk at (x, z) and its eight neighbours, but
+    // only if all nine exist and have finished at least minStage.
+    bool gatherNeighborhood(int x, int z, GenStage minStage, ChunkNeighborhood &out);
+    // Gives c its freshly uploaded buffers, or with a renderer set,
+    // moves their contents into the renderer's and frees them
+    void adoptBuffers(Chunk *c, const ChunkBuffers &buffers);
+
+    // The generation stages. Each is run by exactly one worker at a time
+    // for a given Chunk; scheduleChunkStages() decides when.
+    void generateBase(Chunk *c);
+    void generateSurface(Chunk *c);
+    void generateCaves(Chunk *c);
+    void generateDecorations(const ChunkNeighborhood &hood);
+    // Places the decorations of the sites in [minX, maxX) x [minZ, maxZ)
+    // into whichever Chunks of hood they reach
+    void placeDecorations(const ChunkNeighborhood &hood, int minX, int minZ, int maxX, int maxZ);
+    // Ends a zone's time in flight: DONE, or forgotten if it was cancelled
+    void finishZone(int x, int z, bool done);
+
 public:
     Terrain(OpenGLContext *context);
     ~Terrain();
@@ -63,7 +263,9 @@ public:
     // a Chunk that exists?
     bool hasChunkAt(int x, int z);
     // Assuming a Chunk exists at these coords,
-    // return a mutable reference to it
+    // return a mutable reference to it. Chunks come and go on other
+    // threads, so only call this and hasChunkAt() with chunkMutex held
+    // or where nothing else runs; the main thread has the queries below.
     uPtr<Chunk>& getChunkAt(int x, int z);
     // Assuming a Chunk exists at these coords,
     // return a const reference to it
@@ -72,23 +274,103 @@ public:
     // values) return the block stored at that point in space.
     BlockType getGlobalBlockAt(int x, int y, int z) ;
     BlockType getGlobalBlockAt(glm::vec3 p) ;
+    // Sets out to the block at world-space (x, y, z) and returns true,
+    // or returns false if no Chunk holds it
+    bool findGlobalBlockAt(int x, int y, int z, BlockType &out);
+    // Does the Chunk holding world-space (x, z) exist and have a mesh
+    // on the GPU? Main thread only.
+    bool hasMeshAt(int x, int z);
+    // The y of the highest non-EMPTY block in world column (x, z),
+    // or -1 if the column is empty or has no Chunk
+    int getSurfaceHeight(int x, int z);
     // Given a world-space coordinate (which may have negative
     // values) set the block at that point in space to the
     // given type.
     void setGlobalBlockAt(int x, int y, int z, BlockType t);
 
-    // Draws every Chunk that falls within the bounding box
-    // described by the min and max coords, using the provided
-    // ShaderProgram
-    void draw(int minX, int maxX, int minZ, int maxZ, ShaderProgram *shaderProgram, bool opq = true, bool trans = true);
-    void loadChunkVBOs();
+    // Fills out with the uploaded Chunks this frame's passes draw, once
+    // per frame, for all of them to draw from. The camera pass gets the
+    // Chunks within the bounding box described by the min and max coords.
+    // Given a view, it skips Chunks whose blocks all lie outside its
+    // frustum, and with view->caves the sections a flood fill from the eye
+    // through see-through blocks can't reach. Of the opaque faces, it only
+    // draws the directions that can face the eye from somewhere in the
+    // Chunk's mesh. Each of view->shadows gets the Chunks, wherever they
+    // are, that touch its caster volume.
+    void findVisible(int minX, int maxX, int minZ, int maxZ, const CullView *view, VisibleSet &out);
+    // Draws the Chunks of visible that the given pass wants, using the
+    // provided ShaderProgram
+    void draw(const VisibleSet &visible, ShaderProgram *shaderProgram, RenderPass pass, bool opq = true, bool trans = true);
+    const CullStats& cullStats() const;
+    // Uploads meshed Chunks, closest to the viewer first, until this
+    // frame's byte or time budget runs out. The closest one always goes,
+    // so uploads keep moving however large a mesh is.
+    // With an uploader set, Chunks are handed to it instead, and the
+    // ones it has finished are swapped in first.
+    void loadChunkVBOs(glm::vec2 viewer);
+    void setUploader(GLUploader *uploader);
+    // With a renderer, Chunks' meshes move into its shared buffers as
+    // they upload and draw() batches them into one call per pass. Set
+    // it before anything uploads.
+    void setChunkRenderer(ChunkRenderer *renderer);
+    void setUploadBudget(size_t bytes, double millis);
+    const UploadStats& uploadStats() const;
+    // Swaps the corners of every Chunk whose mesh changed on the GPU
+    // since the last call into out, for whatever caches what it drew
+    void takeMeshChanges(std::vector<glm::ivec2> &out);
 
     // Initializes the Chunks that store the 64 x 256 x 64 block scene you
     // see when the base code is run.
     void CreateTestScene();
 
-    void GenerateTerrain(int x, int z);
+    // Creates the 4 x 4 Chunks of the zone at (x, z) and runs them through
+    // the column-local stages (base, surface, caves). Safe to call from a
+    // worker thread. If `cancelled` fires between stages the zone is left
+    // where it got to and false is returned; generating it again later
+    // picks up from there.
+    bool GenerateTerrain(int x, int z, const CancelToken &cancelled = CancelToken());
+    // Advances every Chunk whose neighbours have caught up: starts
+    // decorations once all nine are carved, and meshing once all nine
+    // are decorated or an edit has left the Chunk DIRTY. Only Chunks
+    // that changed since the last call, and their neighbours, are looked
+    // at. Call from one thread only; the game calls it from its
+    // simulation thread.
+    void scheduleChunkStages();
+    void setJobLauncher(JobLauncher launcher);
+    // Lets remeshes after an edit mesh the Chunk's sections in parallel.
+    // First-time meshes stay on one thread each; there are plenty of
+    // those to go round the workers already.
+    void setParallelFor(ParallelFor parallelFor);
+    // Marks the zone at (x, z) REQUESTED and returns true if the caller
+    // should now queue a GenerateTerrain() job for it. Returns false if
+    // the zone is already requested, running or done, or if the number
+    // of zones in flight is at the limit; ask again later.
+    bool requestZone(int x, int z);
+    void setMaxZonesInFlight(int zones);
+    const ZoneStats& zoneStats() const;
+    // Restricts generation and meshing to Chunks centred within halfSize
+    // blocks of (x, z) along both axes. Everything is of interest until
+    // this is first called.
+    void setInterest(glm::vec2 center, float halfSize);
+    bool isOfInterest(glm::vec2 p) const;
+    void setWorldStore(WorldStore *store);
+    // With meshing off, Chunks stop once their blocks are final
+    void setMeshingEnabled(bool enabled);
+    // Has every block of the Chunk at (x, z) been generated, including
+    // whatever its neighbours' decorations put there?
+    bool isChunkFinal(int x, int z);
+    // ALLOCATED if there's no Chunk at (x, z) yet
+    ChunkState chunkState(int x, int z);
+    // Unloads every finished or cancelled zone lying wholly outside the
+    // square of halfSize blocks about center, and returns how many went. Zones with
+    // an edited Chunk stay, as do ones a job is still reading. Their
+    // Chunks are deleted by the next loadChunkVBOs(), so call this from
+    // the thread that calls scheduleChunkStages() and not the main one.
+    int unloadZonesOutside(glm::vec2 center, float halfSize);
+    size_t loadedChunks();
+    const GenerationStats& generationStats() const;
     //expand terrain
     void expandTerrainIfNeeded(const glm::vec3 &playerPos);
+    // Has GenerateTerrain() started or finished the zone at (x, z)?
     bool hasTerrainAt(int x, int z);
 };
@@ -0,0 +1,148 @@
+#include "worldstore.h"
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+
+static const uint32_t ZONE_MAGIC = 0x5a574d4d; // "MMWZ"
+// Bumped whenever generation changes, so older zones are made again
+static const uint32_t ZONE_VERSION = 2;
+static const uint32_t NO_FACES = 0xffffffff;
+
+WorldStore::WorldStore(const std::string &directory)
+    : m_directory(directory)
+{
+    std::error_code err;
+    std::filesystem::create_directories(m_directory, err);
+}
+
+const std::string& WorldStore::directory() const {
+    return m_directory;
+}
+
+std::string WorldStore::zonePath(int x, int z) const {
+    return m_directory + "/zone_" + std::to_string(x) + "_" + std::to_string(z) + ".bin";
+}
+
+bool WorldStore::hasZone(int x, int z) const {
+    std::error_code err;
+    return std::filesystem::exists(zonePath(x, z), err);
+}
+
+template <typename T>
+static void writeValue(std::ofstream &out, const T &v) {
+    out.write(reinterpret_cast<const char*>(&v), sizeof(T));
+}
+
+template <typename T>
+static bool readValue(std::ifstream &in, T &v) {
+    return static_cast<bool>(in.read(reinterpret_cast<char*>(&v), sizeof(T)));
+}
+
+bool WorldStore::saveZone(int x, int z, const std::vector<Chunk*> &chunks, bool withFaces) {
+    // Write next to the real file and rename over it, so a crash never
+    // leaves a half-written zone behind
+    std::string path = zonePath(x, z);
+    std::string tmpPath = path + ".tmp";
+    {
+        std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+        if (!out) {
+            return false;
+        }
+        writeValue(out, ZONE_MAGIC);
+        writeValue(out, ZONE_VERSION);
+        writeValue(out, static_cast<int32_t>(x));
+        writeValue(out, static_cast<int32_t>(z));
+        writeValue(out, static_cast<uint32_t>(chunks.size()));
+
+        for (Chunk *c : chunks) {
+            std::array<BlockType, 65536> blocks = c->copyBlocks();
+
+            // Runs of identical blocks as (length, type) pairs
+            std::vector<std::pair<uint16_t, uint8_t>> runs;
+            for (size_t i = 0; i < blocks.size();) {
+                size_t j = i;
+                while (j < blocks.size() && blocks[j] == blocks[i] && j - i < 0xffff) {
+                    j++;
+                }
+                runs.emplace_back(static_cast<uint16_t>(j - i), static_cast<uint8_t>(blocks[i]));
+                i = j;
+            }
+            writeValue(out, static_cast<uint32_t>(runs.size()));
+            for (const auto &run : runs) {
+                writeValue(out, run.first);
+                writeValue(out, run.second);
+            }
+
+            if (withFaces) {
+                const std::vector<uint32_t> &faces = c->getFaces();
+                writeValue(out, static_cast<uint32_t>(faces.size()));
+                out.write(reinterpret_cast<const char*>(faces.data()), faces.size() * sizeof(uint32_t));
+            } else {
+                writeValue(out, NO_FACES);
+            }
+        }
+        if (!out) {
+            return false;
+        }
+    }
+    std::error_code err;
+    std::filesystem::rename(tmpPath, path, err);
+    return !err;
+}
+
+bool WorldStore::loadZone(int x, int z, const std::vector<Chunk*> &chunks) const {
+    std::ifstream in(zonePath(x, z), std::ios::binary);
+    if (!in) {
+        return false;
+    }
+    uint32_t magic, version, count;
+    int32_t fileX, fileZ;
+    if (!readValue(in, magic) || !readValue(in, version) || !readValue(in, fileX) || !readValue(in, fileZ) || !readValue(in, count)
+        || magic != ZONE_MAGIC || version != ZONE_VERSION || fileX != x || fileZ != z || count != chunks.size()) {
+        return false;
+    }
+
+    // Decode everything before touching any Chunk
+    std::vector<std::array<BlockType, 65536>> blocks(chunks.size());
+    std::vector<std::vector<uint32_t>> faces(chunks.size());
+    std::vector<bool> hasFaces(chunks.size(), false);
+    for (size_t c = 0; c < chunks.size(); c++) {
+        uint32_t runCount;
+        if (!readValue(in, runCount)) {
+            return false;
+        }
+        size_t filled = 0;
+        for (uint32_t r = 0; r < runCount; r++) {
+            uint16_t length;
+            uint8_t type;
+            if (!readValue(in, length) || !readValue(in, type) || filled + length > blocks[c].size()) {
+                return false;
+            }
+            std::fill_n(blocks[c].begin() + filled, length, static_cast<BlockType>(type));
+            filled += length;
+        }
+        if (filled != blocks[c].size()) {
+            return false;
+        }
+
+        uint32_t faceCount;
+        if (!readValue(in, faceCount)) {
+            return false;
+        }
+        if (faceCount != NO_FACES) {
+            faces[c].resize(faceCount);
+            if (!in.read(reinterpret_cast<char*>(faces[c].data()), faceCount * sizeof(uint32_t))) {
+                return false;
+            }
+            hasFaces[c] = true;
+        }
+    }
+
+    for (size_t c = 0; c < chunks.size(); c++) {
+        chunks[c]->setBlocks(blocks[c]);
+        if (hasFaces[c]) {
+            chunks[c]->setCachedFaces(std::move(faces[c]));
+        }
+    }
+    return true;
+}
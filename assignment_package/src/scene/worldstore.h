@@ -0,0 +1,31 @@
+#pragma once
+#include "chunk.h"
+#include <string>
+
+// Persists generated terrain zones to disk, one file per 64 x 64 zone.
+// Each file holds the 16 Chunks of the zone in the order GenerateTerrain
+// creates them (x-major), with block data run-length encoded and,
+// optionally, the visible faces found when the Chunk was last meshed.
+//
+// Zones are only ever saved once every block in them is final, i.e. all
+// of their Chunks' neighbours have been decorated.
+class WorldStore {
+private:
+    std::string m_directory;
+
+    std::string zonePath(int x, int z) const;
+
+public:
+    WorldStore(const std::string &directory);
+
+    const std::string& directory() const;
+    bool hasZone(int x, int z) const;
+
+    // Writes the zone at (x, z). If withFaces is set each Chunk's
+    // face list is saved too, so loading it skips the neighbour scan
+    // on its first mesh. Returns false if the file can't be written.
+    bool saveZone(int x, int z, const std::vector<Chunk*> &chunks, bool withFaces);
+    // Fills the 16 given Chunks from disk. Returns false, leaving the
+    // Chunks untouched, if the zone isn't stored or the file is damaged.
+    bool loadZone(int x, int z, const std::vector<Chunk*> &chunks) const;
+};
@@ -6,10 +6,17 @@
 #include <QDir>
 
 
+// Indexed by ShaderProgram::Uniform
+static const char *UNIFORM_NAMES[ShaderProgram::UNIFORM_COUNT] = {
+    "u_Model", "u_ModelInvTr", "u_Texture", "u_ShadowMap", "u_PostEffect", "u_Resolution", "u_Time", "u_LightViewProj"
+};
+
 ShaderProgram::ShaderProgram(OpenGLContext *context)
     : vertShader(), fragShader(), prog(),
-      m_isReloading(true), context(context)
-{}
+      m_uniformLocations(), m_isReloading(true), context(context)
+{
+    m_uniformLocations.fill(-1);
+}
 
 void ShaderProgram::destroy() {
     context->glDeleteProgram(prog);
@@ -17,6 +24,7 @@ void ShaderProgram::destroy() {
     context->glDeleteShader(fragShader);
     m_attribs.clear();
     m_unifs.clear();
+    m_uniformLocations.fill(-1);
 }
 
 void ShaderProgram::create(const char *vertfile, const char *fragfile)
@@ -55,6 +63,12 @@ void ShaderProgram::create(const char *vertfile, const char *fragfile)
     context->glAttachShader(prog, vertShader);
     context->glAttachShader(prog, fragShader);
 
+    // Fixed locations for the interleaved attributes, so meshes can set
+    // their VAOs up once for every program
+    context->glBindAttribLocation(prog, ATTRIB_POS, "vs_Pos");
+    context->glBindAttribLocation(prog, ATTRIB_NOR, "vs_Nor");
+    context->glBindAttribLocation(prog, ATTRIB_UV, "vs_UV");
+
     context->glLinkProgram(prog);
     // Check for linking success
     GLint linked;
@@ -64,6 +78,13 @@ void ShaderProgram::create(const char *vertfile, const char *fragfile)
     }
 
     parseShaderSourceForVariables(vertSource, fragSource);
+    for (int u = 0; u < UNIFORM_COUNT; u++) {
+        m_uniformLocations[u] = context->glGetUniformLocation(prog, UNIFORM_NAMES[u]);
+    }
+    GLuint frameBlock = context->glGetUniformBlockIndex(prog, "FrameData");
+    if (frameBlock != GL_INVALID_INDEX) {
+        context->glUniformBlockBinding(prog, frameBlock, FRAME_UNIFORMS_BINDING);
+    }
     delete[] vertSource;
     delete[] fragSource;
 
@@ -109,76 +130,77 @@ void ShaderProgram::useMe() {
     context->glUseProgram(prog);
 }
 
-void ShaderProgram::setUnifMat4(std::string name, const glm::mat4 &m) {
+void ShaderProgram::setUnifMat4(const std::string &name, const glm::mat4 &m) {
     useMe();
-    try {
-        int handle = m_unifs.at(name);
-        if(handle != -1) {
-            context->glUniformMatrix4fv(handle, 1, GL_FALSE, &m[0][0]);
-        }
-    }
-    catch(std::out_of_range &e) {
-        // std::cout << "Error: could not find shader variable with name " << name << std::endl;
+    auto it = m_unifs.find(name);
+    if (it != m_unifs.end() && it->second != -1) {
+        context->glUniformMatrix4fv(it->second, 1, GL_FALSE, &m[0][0]);
     }
 }
-void ShaderProgram::setUnifVec2(std::string name, const glm::vec2 &v) {
+void ShaderProgram::setUnifVec2(const std::string &name, const glm::vec2 &v) {
     useMe();
-    try {
-        int handle = m_unifs.at(name);
-        if(handle != -1) {
-            context->glUniform2fv(handle, 1, &v[0]);
-        }
-    }
-    catch(std::out_of_range &e) {
-        // std::cout << "Error: could not find shader variable with name " << name << std::endl;
+    auto it = m_unifs.find(name);
+    if (it != m_unifs.end() && it->second != -1) {
+        context->glUniform2fv(it->second, 1, &v[0]);
     }
 }
-void ShaderProgram::setUnifVec3(std::string name, const glm::vec3 &v) {
+void ShaderProgram::setUnifVec3(const std::string &name, const glm::vec3 &v) {
     useMe();
-    try {
-        int handle = m_unifs.at(name);
-        if(handle != -1) {
-            context->glUniform3fv(handle, 1, &v[0]);
-        }
+    auto it = m_unifs.find(name);
+    if (it != m_unifs.end() && it->second != -1) {
+        context->glUniform3fv(it->second, 1, &v[0]);
     }
-    catch(std::out_of_range &e) {
-        // std::cout << "Error: could not find shader variable with name " << name << std::endl;
+}
+void ShaderProgram::setUnifFloat(const std::string &name, float f) {
+    useMe();
+    auto it = m_unifs.find(name);
+    if (it == m_unifs.end()) {
+        std::cout << "Error: could not find shader variable with name " << name << std::endl;
+    } else if (it->second != -1) {
+        context->glUniform1f(it->second, f);
     }
 }
-void ShaderProgram::setUnifFloat(std::string name, float f) {
+void ShaderProgram::setUnifInt(const std::string &name, int i) {
     useMe();
-    try {
-        int handle = m_unifs.at(name);
-        if(handle != -1) {
-            context->glUniform1f(handle, f);
-        }
+    auto it = m_unifs.find(name);
+    if (it == m_unifs.end()) {
+        std::cout << "Error: could not find shader variable with name " << name << std::endl;
+    } else if (it->second != -1) {
+        context->glUniform1i(it->second, i);
     }
-    catch(std::out_of_range &e) {
+}
+void ShaderProgram::setUnifArrayInt(const std::string &name, int offset, int i) {
+    useMe();
+    auto it = m_unifs.find(name);
+    if (it == m_unifs.end()) {
         std::cout << "Error: could not find shader variable with name " << name << std::endl;
+    } else if (it->second != -1) {
+        context->glUniform1i(it->second + offset, i);
     }
 }
-void ShaderProgram::setUnifInt(std::string name, int i) {
+
+void ShaderProgram::setUnifMat4(Uniform u, const glm::mat4 &m) {
     useMe();
-    try {
-        int handle = m_unifs.at(name);
-        if(handle != -1) {
-            context->glUniform1i(handle, i);
-        }
+    if (m_uniformLocations[u] != -1) {
+        context->glUniformMatrix4fv(m_uniformLocations[u], 1, GL_FALSE, &m[0][0]);
     }
-    catch(std::out_of_range &e) {
-        std::cout << "Error: could not find shader variable with name " << name << std::endl;
+}
+void ShaderProgram::setUnifVec2(Uniform u, const glm::vec2 &v) {
+    useMe();
+    if (m_uniformLocations[u] != -1) {
+        context->glUniform2fv(m_uniformLocations[u], 1, &v[0]);
     }
 }
-void ShaderProgram::setUnifArrayInt(std::string name, int offset, int i) {
+void ShaderProgram::setUnifFloat(Uniform u, float f) {
     useMe();
-    try {
-        int handle = m_unifs.at(name);
-        if(handle != -1) {
-            context->glUniform1i(handle + offset, i);
-        }
+    if (m_uniformLocations[u] != -1) {
+        context->glUniform1f(m_uniformLocations[u], f);
     }
-    catch(std::out_of_range &e) {
-        std::cout << "Error: could not find shader variable with name " << name << std::endl;
+}
+void ShaderProgram::setUnifInt(Uniform u, int i) {
+    useMe();
+    if (m_uniformLocations[u] != -1) {
+        context->glUniform1i(m_uniformLocations[u], i);
     }
 }
 
@@ -331,7 +353,7 @@ void ShaderProgram::drawSky(Drawable &sky) {
 }
 
 
-void ShaderProgram::drawOpq(Drawable &d) {
+void ShaderProgram::drawOpq(Drawable &d, int first, int count) {
     // std::cout << "debug: element count for INDEX: " << d.elemCount(INDEX) << std::endl;
     if (d.elemCount(OPQ_INDEX) < 0) {
         throw std::invalid_argument(
@@ -340,6 +362,17 @@ void ShaderProgram::drawOpq(Drawable &d) {
     }
     useMe();
 
+    // Everything's already in the Drawable's VAO, if it has one. It stays
+    // bound afterwards; whoever drew with the shared VAO rebinds it.
+    GLuint vao = d.vertexArray(OPQ_INDEX);
+    if (vao != 0) {
+        context->glBindVertexArray(vao);
+        context->glDrawElements(d.drawMode(), count < 0 ? d.elemCount(OPQ_INDEX) : count, GL_UNSIGNED_INT,
+                                reinterpret_cast<void*>(first * sizeof(GLuint)));
+        context->printGLErrorLog();
+        return;
+    }
+
 
     const GLsizei stride = 3 * sizeof(glm::vec4);
 
@@ -360,7 +393,8 @@ void ShaderProgram::drawOpq(Drawable &d) {
 
 
     d.bindBuffer(OPQ_INDEX);
-    context->glDrawElements(d.drawMode(), d.elemCount(OPQ_INDEX), GL_UNSIGNED_INT, 0);
+    context->glDrawElements(d.drawMode(), count < 0 ? d.elemCount(OPQ_INDEX) : count, GL_UNSIGNED_INT,
+                            reinterpret_cast<void*>(first * sizeof(GLuint)));
 
     if (m_attribs["vs_Pos"] != -1) context->glDisableVertexAttribArray(m_attribs["vs_Pos"]);
     if (m_attribs["vs_Nor"] != -1) context->glDisableVertexAttribArray(m_attribs["vs_Nor"]);
@@ -369,7 +403,7 @@ void ShaderProgram::drawOpq(Drawable &d) {
     context->printGLErrorLog();
 }
 
-void ShaderProgram::drawTrans(Drawable &d) {
+void ShaderProgram::drawTrans(Drawable &d, int first, int count) {
     // std::cout << "debug: element count for INDEX: " << d.elemCount(INDEX) << std::endl;
     if (d.elemCount(TRANS_INDEX) < 0) {
         throw std::invalid_argument(
@@ -378,6 +412,17 @@ void ShaderProgram::drawTrans(Drawable &d) {
     }
     useMe();
 
+    // Everything's already in the Drawable's VAO, if it has one. It stays
+    // bound afterwards; whoever drew with the shared VAO rebinds it.
+    GLuint vao = d.vertexArray(TRANS_INDEX);
+    if (vao != 0) {
+        context->glBindVertexArray(vao);
+        context->glDrawElements(d.drawMode(), count < 0 ? d.elemCount(TRANS_INDEX) : count, GL_UNSIGNED_INT,
+                                reinterpret_cast<void*>(first * sizeof(GLuint)));
+        context->printGLErrorLog();
+        return;
+    }
+
 
     const GLsizei stride = 3 * sizeof(glm::vec4);
 
@@ -398,7 +443,8 @@ void ShaderProgram::drawTrans(Drawable &d) {
 
 
     d.bindBuffer(TRANS_INDEX);
-    context->glDrawElements(d.drawMode(), d.elemCount(TRANS_INDEX), GL_UNSIGNED_INT, 0);
+    context->glDrawElements(d.drawMode(), count < 0 ? d.elemCount(TRANS_INDEX) : count, GL_UNSIGNED_INT,
+                            reinterpret_cast<void*>(first * sizeof(GLuint)));
 
     if (m_attribs["vs_Pos"] != -1) context->glDisableVertexAttribArray(m_attribs["vs_Pos"]);
     if (m_attribs["vs_Nor"] != -1) context->glDisableVertexAttribArray(m_attribs["vs_Nor"]);
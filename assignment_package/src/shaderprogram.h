@@ -5,10 +5,29 @@
 #include <glm_includes.h>
 #include <glm/glm.hpp>
 #include "drawable.h"
+#include <array>
 #include <unordered_map>
 
 #define dict std::unordered_map
 
+// How many shadow maps ShadowCascades renders. The .glsl files size
+// their arrays of them to match.
+static constexpr int SHADOW_CASCADES = 3;
+
+// The FrameData uniform block the scene shaders share, as std140 lays it
+// out. Keep it in step with the block declared in the .glsl files.
+struct FrameUniforms {
+    glm::mat4 viewProj;
+    glm::mat4 viewProjInv;
+    glm::mat4 shadowMVP[SHADOW_CASCADES]; // World to each cascade's texture space, finest first
+    glm::vec4 cameraPos;
+    glm::vec4 lightDir;     // Normalized, towards the light
+    float time;
+    float padding[3];       // std140 rounds the block up to a vec4
+};
+
+// Where FrameData is bound in every program
+static constexpr GLuint FRAME_UNIFORMS_BINDING = 0;
 
 class ShaderProgram
 {
@@ -20,6 +39,14 @@ public:
     dict<std::string, int> m_attribs;
     dict<std::string, int> m_unifs;
 
+    // Uniforms set outside FrameData, looked up once when the program is
+    // linked. A program without one has -1 for it.
+    enum Uniform : unsigned char {
+        U_MODEL, U_MODEL_INV_TR, U_TEXTURE, U_SHADOW_MAP, U_POST_EFFECT, U_RESOLUTION, U_TIME, U_LIGHT_VIEW_PROJ,
+        UNIFORM_COUNT
+    };
+    std::array<int, UNIFORM_COUNT> m_uniformLocations;
+
     bool m_isReloading;
 
 public:
@@ -38,12 +65,17 @@ public:
 
     void parseShaderSourceForVariables(char *vertSource, char *fragSource);
 
-    void setUnifMat4(std::string name, const glm::mat4 &m);
-    void setUnifVec2(std::string name, const glm::vec2 &v);
-    void setUnifVec3(std::string name, const glm::vec3 &v);
-    void setUnifFloat(std::string name, float f);
-    void setUnifInt(std::string name, int i);
-    void setUnifArrayInt(std::string name, int offset, int i);
+    void setUnifMat4(const std::string &name, const glm::mat4 &m);
+    void setUnifVec2(const std::string &name, const glm::vec2 &v);
+    void setUnifVec3(const std::string &name, const glm::vec3 &v);
+    void setUnifFloat(const std::string &name, float f);
+    void setUnifInt(const std::string &name, int i);
+    void setUnifArrayInt(const std::string &name, int offset, int i);
+    // The same through the locations found at link time, without a lookup
+    void setUnifMat4(Uniform u, const glm::mat4 &m);
+    void setUnifVec2(Uniform u, const glm::vec2 &v);
+    void setUnifFloat(Uniform u, float f);
+    void setUnifInt(Uniform u, int i);
 
     // Draw the given object to our screen using this ShaderProgram's shaders
     void draw(Drawable &d);
@@ -52,8 +84,11 @@ public:
     //new draw function for interleaved VBOs
     void drawInterleaved(Drawable &d);
     void drawSky(Drawable &sky);
-    void drawOpq(Drawable &d);
-    void drawTrans(Drawable &d);
+    // Draw count indices of the opaque or transparent index buffer from
+    // index first on; by default, all of them. Drawables with a VAO for
+    // the index buffer leave it bound.
+    void drawOpq(Drawable &d, int first = 0, int count = -1);
+    void drawTrans(Drawable &d, int first = 0, int count = -1);
     // Utility function used in create()
     char* textFileRead(const char*);
     // Utility function that prints any shader compilation errors to the console
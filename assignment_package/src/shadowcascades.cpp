@@ -0,0 +1,180 @@
+#include "shadowcascades.h"
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+// Blocks from the player to the edge of each cascade, finest first. The
+// last matches the single map this replaced.
+static constexpr std::array<float, SHADOW_CASCADES> CASCADE_HALF_SIZES = {20.f, 48.f, 100.f};
+// A cascade's centre moves in steps of this fraction of its size. Any
+// resolution divisible by 2 / SNAP_FRACTION keeps them whole texels.
+static constexpr float SNAP_FRACTION = 0.25f;
+
+ShadowCascades::ShadowCascades(OpenGLContext *context, int resolution)
+    : mp_context(context), m_resolution(resolution), m_depthTexture(0), m_lightView(1.f), m_cascades(), m_created(false)
+{
+    for (int i = 0; i < SHADOW_CASCADES; i++) {
+        m_cascades[i].halfSize = CASCADE_HALF_SIZES[i];
+        m_cascades[i].depthHalfRange = DEPTH_HALF_RANGE;
+        m_cascades[i].center = glm::vec3(0.f);
+        m_cascades[i].lightDir = glm::vec3(0.f);
+        m_cascades[i].viewProj = glm::mat4(1.f);
+        m_cascades[i].rendered = false;
+        m_cascades[i].frameBuffer = 0;
+    }
+}
+
+void ShadowCascades::create() {
+    mp_context->glGenTextures(1, &m_depthTexture);
+    mp_context->glActiveTexture(GL_TEXTURE0);
+    mp_context->glBindTexture(GL_TEXTURE_2D_ARRAY, m_depthTexture);
+    mp_context->glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    mp_context->glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    mp_context->glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    mp_context->glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    // lambert.frag.glsl compares depths itself
+    mp_context->glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_MODE, GL_NONE);
+    mp_context->glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_DEPTH_COMPONENT16, m_resolution, m_resolution, SHADOW_CASCADES,
+                             0, GL_DEPTH_COMPONENT, GL_FLOAT, nullptr);
+
+    m_created = true;
+    for (int i = 0; i < SHADOW_CASCADES; i++) {
+        Cascade &c = m_cascades[i];
+        mp_context->glGenFramebuffers(1, &c.frameBuffer);
+        mp_context->glBindFramebuffer(GL_FRAMEBUFFER, c.frameBuffer);
+        mp_context->glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, m_depthTexture, 0, i);
+        GLenum drawBuffers[1] = {GL_NONE};
+        mp_context->glDrawBuffers(1, drawBuffers);
+        mp_context->glReadBuffer(GL_NONE);
+        if (mp_context->glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+            m_created = false;
+            std::cout << "Shadow cascade " << i << " did not initialize correctly..." << std::endl;
+        }
+        c.rendered = false;
+    }
+    mp_context->glBindFramebuffer(GL_FRAMEBUFFER, mp_context->defaultFramebufferObject());
+}
+
+void ShadowCascades::destroy() {
+    for (Cascade &c : m_cascades) {
+        if (c.frameBuffer != 0) {
+            mp_context->glDeleteFramebuffers(1, &c.frameBuffer);
+            c.frameBuffer = 0;
+        }
+        c.rendered = false;
+    }
+    if (m_depthTexture != 0) {
+        mp_context->glDeleteTextures(1, &m_depthTexture);
+        m_depthTexture = 0;
+    }
+    m_created = false;
+}
+
+void ShadowCascades::setRenderDistance(int blocks) {
+    const float scale = float(blocks) / DEFAULT_RENDER_DISTANCE;
+    for (int i = 0; i < SHADOW_CASCADES; i++) {
+        Cascade &c = m_cascades[i];
+        // Linear for the last, square root for those between, none for the first
+        float t = SHADOW_CASCADES > 1 ? float(i) / (SHADOW_CASCADES - 1) : 1.f;
+        c.halfSize = CASCADE_HALF_SIZES[i] * std::pow(scale, t);
+        // Terrain spans more depth across a wider map, the light being slanted
+        c.depthHalfRange = DEPTH_HALF_RANGE * std::max(1.f, scale);
+        c.rendered = false;
+    }
+}
+
+bool ShadowCascades::covers(const Cascade &c, glm::ivec2 chunk) const {
+    glm::vec2 lo(1e30f), hi(-1e30f);
+    for (int corner = 0; corner < 8; corner++) {
+        glm::vec4 p = c.viewProj * glm::vec4(chunk.x + ((corner & 1) ? 16.f : 0.f),
+                                             (corner & 2) ? 256.f : 0.f,
+                                             chunk.y + ((corner & 4) ? 16.f : 0.f), 1.f);
+        lo = glm::min(lo, glm::vec2(p));
+        hi = glm::max(hi, glm::vec2(p));
+    }
+    return lo.x <= 1.f && hi.x >= -1.f && lo.y <= 1.f && hi.y >= -1.f;
+}
+
+unsigned ShadowCascades::update(glm::vec3 focus, glm::vec3 lightDir, const std::vector<glm::ivec2> &changedChunks) {
+    lightDir = glm::normalize(lightDir);
+    // Only rotated, so a point's light-space position moves with it
+    // rather than with wherever the maps are centred
+    m_lightView = glm::lookAt(glm::vec3(0.f), -lightDir, glm::normalize(glm::cross(lightDir, glm::vec3(0, 0, -1))));
+    glm::vec3 lightFocus = glm::vec3(m_lightView * glm::vec4(focus, 1.f));
+
+    unsigned stale = 0;
+    for (int i = 0; i < SHADOW_CASCADES; i++) {
+        Cascade &c = m_cascades[i];
+        float step = c.halfSize * SNAP_FRACTION;
+        glm::vec3 center = glm::round(lightFocus / step) * step;
+        bool turned = glm::dot(lightDir, c.lightDir) < std::cos(LIGHT_TOLERANCE);
+        if (!c.rendered || turned || center != c.center) {
+            c.center = center;
+            c.lightDir = lightDir;
+            // Light space looks down -z, so depth runs the other way
+            glm::mat4 proj = glm::ortho(center.x - c.halfSize, center.x + c.halfSize,
+                                        center.y - c.halfSize, center.y + c.halfSize,
+                                        -center.z - c.depthHalfRange, -center.z + c.depthHalfRange);
+            c.viewProj = proj * m_lightView;
+            stale |= 1u << i;
+            continue;
+        }
+        for (glm::ivec2 chunk : changedChunks) {
+            if (covers(c, chunk)) {
+                stale |= 1u << i;
+                break;
+            }
+        }
+    }
+    // Nothing's drawn to a cascade that failed to initialize
+    return m_created ? stale : 0;
+}
+
+void ShadowCascades::bindCascade(int i) {
+    mp_context->glBindFramebuffer(GL_FRAMEBUFFER, m_cascades[i].frameBuffer);
+    mp_context->glViewport(0, 0, m_resolution, m_resolution);
+    mp_context->glClear(GL_DEPTH_BUFFER_BIT);
+    m_cascades[i].rendered = true;
+}
+
+const glm::mat4& ShadowCascades::viewProj(int i) const {
+    return m_cascades[i].viewProj;
+}
+
+glm::mat4 ShadowCascades::textureMatrix(int i) const {
+    glm::mat4 biasMatrix(
+        0.5, 0.0, 0.0, 0.0,
+        0.0, 0.5, 0.0, 0.0,
+        0.0, 0.0, 0.5, 0.0,
+        0.5, 0.5, 0.5, 1.0
+        );
+    return biasMatrix * m_cascades[i].viewProj;
+}
+
+glm::mat4 ShadowCascades::casterViewProj(int i, float reach) const {
+    const Cascade &c = m_cascades[i];
+    // The player can be up to half a snap step from the centre before
+    // the cascade moves
+    reach += c.halfSize * SNAP_FRACTION;
+    glm::vec3 worldCenter = glm::vec3(glm::inverse(m_lightView) * glm::vec4(c.center, 1.f));
+    glm::vec3 lo(1e30f), hi(-1e30f);
+    for (int corner = 0; corner < 8; corner++) {
+        glm::vec3 p = glm::vec3(m_lightView * glm::vec4(worldCenter.x + ((corner & 1) ? reach : -reach),
+                                                         (corner & 2) ? 256.f : 0.f,
+                                                         worldCenter.z + ((corner & 4) ? reach : -reach), 1.f));
+        lo = glm::min(lo, p);
+        hi = glm::max(hi, p);
+    }
+    // Only rays through those blocks matter, and only the stretch of them
+    // on the light's side of the furthest block from it
+    glm::vec2 minXY = glm::max(glm::vec2(lo), glm::vec2(c.center) - c.halfSize);
+    glm::vec2 maxXY = glm::min(glm::vec2(hi), glm::vec2(c.center) + c.halfSize);
+    float nearZ = c.center.z + c.depthHalfRange;
+    float farZ = std::max(c.center.z - c.depthHalfRange, lo.z);
+    return glm::ortho(minXY.x, maxXY.x, minXY.y, maxXY.y, -nearZ, -farZ) * m_lightView;
+}
+
+void ShadowCascades::bindToTextureSlot(unsigned int slot) {
+    mp_context->glActiveTexture(GL_TEXTURE0 + slot);
+    mp_context->glBindTexture(GL_TEXTURE_2D_ARRAY, m_depthTexture);
+}
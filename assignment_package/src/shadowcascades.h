@@ -0,0 +1,78 @@
+#pragma once
+#include "openglcontext.h"
+#include "shaderprogram.h"
+#include <glm_includes.h>
+#include <array>
+#include <vector>
+
+// Cascaded shadow maps for a directional light: SHADOW_CASCADES square
+// maps centred on the player, each covering more of the world at a
+// coarser resolution than the last, held as the layers of one depth
+// texture array.
+//
+// A cascade keeps what it last rendered until it goes stale: the light
+// turns by more than LIGHT_TOLERANCE, the player moves far enough that
+// its centre snaps to a new spot, or a Chunk inside it gets a new mesh.
+// Centres snap to whole texels of their map, so a cascade that moves
+// doesn't shimmer either.
+class ShadowCascades {
+private:
+    struct Cascade {
+        float halfSize;     // Blocks from the centre to an edge
+        float depthHalfRange; // Light-space depth covered either side of the centre
+        glm::vec3 center;   // In light space, snapped
+        glm::vec3 lightDir; // What it was rendered with
+        glm::mat4 viewProj; // World to this cascade's clip space
+        bool rendered;
+        GLuint frameBuffer;
+    };
+
+    OpenGLContext *mp_context; // Not owned
+    int m_resolution;          // Texels along each side of every map
+    GLuint m_depthTexture;
+    glm::mat4 m_lightView; // World to light space, rotation only
+    std::array<Cascade, SHADOW_CASCADES> m_cascades;
+    bool m_created;
+
+    // Does the Chunk with its lower-left corner at chunk fall inside c?
+    bool covers(const Cascade &c, glm::ivec2 chunk) const;
+
+public:
+    // How far the light may turn, in radians, before every cascade redraws
+    static constexpr float LIGHT_TOLERANCE = 0.005f;
+    // Light-space depth a map covers either side of its centre, at the
+    // default render distance. Wider cascades cover proportionally more.
+    static constexpr float DEPTH_HALF_RANGE = 192.f;
+    // The render distance CASCADE_HALF_SIZES in the .cpp are sized for
+    static constexpr int DEFAULT_RENDER_DISTANCE = 64;
+
+    ShadowCascades(OpenGLContext *context, int resolution);
+
+    // Initialize all GPU-side data required
+    void create();
+    // Deallocate all GPU-side data
+    void destroy();
+    // Sizes the cascades for a world drawn out to blocks from the player:
+    // the last reaches past it by as much as it does by default, the
+    // finest stays put and the middle one sits between them. Every
+    // cascade is redrawn on the next update().
+    void setRenderDistance(int blocks);
+
+    // Moves the cascades to follow focus, with the light shining from
+    // lightDir, and returns which of them need rendering again, one bit
+    // each. changedChunks are the corners of Chunks with new meshes.
+    unsigned update(glm::vec3 focus, glm::vec3 lightDir, const std::vector<glm::ivec2> &changedChunks);
+    // Binds cascade i's map as the render target and clears it. Marks it
+    // rendered, so draw into it before the next update().
+    void bindCascade(int i);
+    // World to cascade i's clip space, to render it with
+    const glm::mat4& viewProj(int i) const;
+    // World to cascade i's texture space, to look it up with
+    glm::mat4 textureMatrix(int i) const;
+    // World to the clip space of the part of cascade i that can cast a
+    // shadow on blocks within reach blocks of the player, along x and z,
+    // for as long as the cascade stays where it is. Anything outside it
+    // needn't be drawn into the cascade.
+    glm::mat4 casterViewProj(int i, float reach) const;
+    void bindToTextureSlot(unsigned int slot);
+};
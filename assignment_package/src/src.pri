@@ -20,7 +20,15 @@ SOURCES += \
     $$PWD/scene/camera.cpp \
     $$PWD/playerinfo.cpp \
     $$PWD/scene/chunk.cpp \
-    $$PWD/texture.cpp
+    $$PWD/texture.cpp \
+    $$PWD/jobsystem.cpp \
+    $$PWD/gluploader.cpp \
+    $$PWD/chunkrenderer.cpp \
+    $$PWD/shadowcascades.cpp \
+    $$PWD/pregenerate.cpp \
+    $$PWD/scene/worldstore.cpp \
+    $$PWD/scene/placement.cpp \
+    $$PWD/scene/frustum.cpp
 
 HEADERS += \
     $$PWD/framebuffer.h \
@@ -42,4 +50,13 @@ HEADERS += \
     $$PWD/scene/camera.h \
     $$PWD/playerinfo.h \
     $$PWD/scene/chunk.h \
-    $$PWD/texture.h
+    $$PWD/texture.h \
+    $$PWD/jobsystem.h \
+    $$PWD/mpscqueue.h \
+    $$PWD/gluploader.h \
+    $$PWD/chunkrenderer.h \
+    $$PWD/shadowcascades.h \
+    $$PWD/pregenerate.h \
+    $$PWD/scene/worldstore.h \
+    $$PWD/scene/placement.h \
+    $$PWD/scene/frustum.h
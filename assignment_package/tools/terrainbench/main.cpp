@@ -0,0 +1,108 @@
+#include "scene/terrain.h"
+#include "jobsystem.h"
+
+#include <iostream>
+#include <iomanip>
+#include <thread>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+
+// Generates a square of terrain zones without ever touching OpenGL and
+// reports how fast each stage ran. Chunks are built with a null context;
+// nothing here calls loadToGPU() or draws.
+
+static const char *stageNames[] = {"none", "base", "surface", "caves", "decorations", "mesh"};
+
+static int intArg(int argc, char *argv[], const char *name, int fallback) {
+    for (int i = 1; i + 1 < argc; i++) {
+        if (std::strcmp(argv[i], name) == 0) {
+            return std::max(1, std::atoi(argv[i + 1]));
+        }
+    }
+    return fallback;
+}
+
+int main(int argc, char *argv[])
+{
+    const int zones = intArg(argc, argv, "--zones", 4);
+    const int threads = intArg(argc, argv, "--threads", std::max(1u, std::thread::hardware_concurrency()));
+
+    Terrain terrain(nullptr);
+    auto start = std::chrono::steady_clock::now();
+    JobStats jobStats;
+    // When the Chunk in the middle of the square, where the "player"
+    // stands, was first ready to draw
+    double firstVisible = -1.0;
+    {
+        JobSystem workers(threads);
+        terrain.setJobLauncher([&workers](glm::vec2 where, std::function<void()> job) { workers.push(std::move(job), where); });
+
+        // Look along +x from the middle of the square, as a player would
+        const glm::vec2 middle(32 * zones, 32 * zones);
+        workers.setFocus(middle, glm::vec2(1, 0));
+        for (int i = 0; i < zones; i++) {
+            for (int j = 0; j < zones; j++) {
+                workers.push([&terrain, i, j]() { terrain.GenerateTerrain(64 * i, 64 * j); }, glm::vec2(64 * i + 32, 64 * j + 32));
+            }
+        }
+
+        // Only Chunks with all eight neighbours generated can be decorated,
+        // and only those with all eight neighbours decorated can be meshed.
+        // The outer ring of the square never gets there.
+        const int side = 4 * zones;
+        const int64_t meshTarget = side > 4 ? int64_t(side - 4) * (side - 4) : 0;
+        while (terrain.generationStats().chunks[static_cast<int>(GenStage::MESH)] < meshTarget) {
+            terrain.scheduleChunkStages();
+            if (firstVisible < 0 && terrain.chunkState(middle.x, middle.y) == ChunkState::MESHED) {
+                firstVisible = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        terrain.setJobLauncher([](glm::vec2, std::function<void()> job) { job(); });
+        jobStats = workers.stats();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // FNV-1a over every block in a fixed order, so runs with different
+    // thread counts can be compared
+    uint64_t checksum = 14695981039346656037ull;
+    for (int x = 0; x < 64 * zones; x += 16) {
+        for (int z = 0; z < 64 * zones; z += 16) {
+            const uPtr<Chunk> &c = terrain.getChunkAt(x, z);
+            for (int y = 0; y < 256; y++) {
+                for (int lz = 0; lz < 16; lz++) {
+                    for (int lx = 0; lx < 16; lx++) {
+                        checksum ^= c->getLocalBlockAt(lx, y, lz);
+                        checksum *= 1099511628211ull;
+                    }
+                }
+            }
+        }
+    }
+
+    const GenerationStats &stats = terrain.generationStats();
+    const int64_t chunks = int64_t(16) * zones * zones;
+
+    std::cout << std::fixed << std::setprecision(2);
+    std::cout << "zones:      " << zones << " x " << zones << " (" << chunks << " chunks)" << std::endl;
+    std::cout << "threads:    " << threads << std::endl;
+    std::cout << "wall time:  " << seconds * 1000.0 << " ms" << std::endl;
+    std::cout << "chunks/s:   " << chunks / seconds << std::endl;
+    std::cout << "blocks/s:   " << chunks * 65536 / seconds << std::endl;
+    std::cout << "stage          chunks    total ms   avg ms" << std::endl;
+    for (int s = static_cast<int>(GenStage::BASE); s <= static_cast<int>(GenStage::MESH); s++) {
+        int64_t n = stats.chunks[s];
+        double ms = stats.nanos[s] / 1e6;
+        std::cout << std::left << std::setw(14) << stageNames[s] << std::right
+                  << std::setw(7) << n
+                  << std::setw(12) << ms
+                  << std::setw(9) << (n > 0 ? ms / n : 0.0) << std::endl;
+    }
+    std::cout << "middle:     meshed after " << firstVisible * 1000.0 << " ms" << std::endl;
+    std::cout << "jobs:       " << jobStats.completed << " run (" << jobStats.stolen << " stolen), peak queue " << jobStats.peakQueued << std::endl;
+    std::cout << "job wait:   " << jobStats.meanWaitMs << " ms avg, " << jobStats.maxWaitMs << " ms max" << std::endl;
+    std::cout << "job run:    " << jobStats.meanRunMs << " ms avg, " << jobStats.maxRunMs << " ms max" << std::endl;
+    std::cout << "checksum:   " << std::hex << checksum << std::dec << std::endl;
+    return 0;
+}
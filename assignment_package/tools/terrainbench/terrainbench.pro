@@ -0,0 +1,49 @@
+# Terrain generation benchmark. Builds the generation code without
+# MainWindow or MyGL, and never opens a window or makes a GL context, so
+# it runs without a display. It still links Qt's GUI and OpenGL modules:
+# terrain.h reaches the GL types through Chunk's Drawable base and the
+# upload and renderer headers.
+#
+#   TerrainBench [--zones N] [--threads T]
+
+QT += core gui widgets openglwidgets
+
+TARGET = TerrainBench
+TEMPLATE = app
+CONFIG += console
+CONFIG -= app_bundle
+CONFIG += c++1z
+CONFIG += release
+
+INCLUDEPATH += ../../include ../../src
+
+SOURCES += \
+    main.cpp \
+    ../../src/chunkrenderer.cpp \
+    ../../src/drawable.cpp \
+    ../../src/gluploader.cpp \
+    ../../src/jobsystem.cpp \
+    ../../src/shaderprogram.cpp \
+    ../../src/scene/chunk.cpp \
+    ../../src/scene/frustum.cpp \
+    ../../src/scene/placement.cpp \
+    ../../src/scene/terrain.cpp \
+    ../../src/scene/worldstore.cpp
+
+HEADERS += \
+    ../../src/chunkrenderer.h \
+    ../../src/drawable.h \
+    ../../src/gluploader.h \
+    ../../src/jobsystem.h \
+    ../../src/mpscqueue.h \
+    ../../src/shaderprogram.h \
+    ../../src/scene/chunk.h \
+    ../../src/scene/frustum.h \
+    ../../src/scene/placement.h \
+    ../../src/scene/terrain.h \
+    ../../src/scene/worldstore.h
+
+*-clang*|*-g++* {
+    QMAKE_CXXFLAGS += -Wall -Wextra -pedantic -Winit-self
+    QMAKE_CXXFLAGS += -Wno-strict-aliasing
+}